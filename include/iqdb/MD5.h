@@ -1,9 +1,25 @@
+#ifndef IQDB_MD5_H
+#define IQDB_MD5_H
 
+#include <array>
+#include <cstdint>
+#include <optional>
 #include <string>
+#include <string_view>
 
 namespace iqdb
 {
 
-std::string getMD5(const std::string& data);
+// An MD5 hash as raw bytes, for keeping in memory.
+using md5_digest = std::array<uint8_t, 16>;
+
+std::string getMD5(std::string_view data);
+
+// Convert an MD5 hash between its 32-digit hex form and raw bytes. Returns
+// nullopt if `hex` isn't 32 hex digits.
+std::optional<md5_digest> md5FromHex(std::string_view hex);
+std::string md5ToHex(const md5_digest& digest);
 
 }
+
+#endif
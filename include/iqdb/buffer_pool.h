@@ -0,0 +1,49 @@
+#ifndef IQDB_BUFFER_POOL_H
+#define IQDB_BUFFER_POOL_H
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace iqdb {
+
+// A pool of buffers for receiving uploaded files, reused from one request to
+// the next so that reading an upload doesn't allocate and regrow a new buffer
+// every time. Buffers are only kept while their total size is under
+// max_bytes, so that one huge upload doesn't pin its memory forever.
+class buffer_pool {
+public:
+  // A buffer borrowed from the pool. It goes back to the pool, emptied, when
+  // it's destroyed.
+  class buffer {
+  public:
+    buffer(buffer_pool& pool, std::string data) : pool_(&pool), data_(std::move(data)) {}
+    buffer(buffer&& other) noexcept : pool_(other.pool_), data_(std::move(other.data_)) { other.pool_ = nullptr; }
+    buffer& operator=(buffer&&) = delete;
+    ~buffer() { if (pool_) pool_->release(std::move(data_)); }
+
+    std::string& data() noexcept { return data_; }
+    std::string_view view() const noexcept { return data_; }
+
+  private:
+    buffer_pool* pool_;
+    std::string data_;
+  };
+
+  explicit buffer_pool(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+  buffer acquire();
+
+private:
+  void release(std::string data);
+
+  const size_t max_bytes_;
+  std::mutex mutex_;
+  std::vector<std::string> free_; // Buffers not lent out. Guarded by mutex_.
+  size_t free_bytes_ = 0;         // Total capacity of free_. Guarded by mutex_.
+};
+
+}
+
+#endif
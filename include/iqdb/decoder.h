@@ -0,0 +1,48 @@
+#ifndef IQDB_DECODER_H
+#define IQDB_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <iqdb/resizer.h>
+
+namespace iqdb {
+
+// What a decoder can tell about an image from its headers alone.
+struct image_info {
+  unsigned int width;
+  unsigned int height;
+
+  // The most pixels the decoder holds in memory at once while decoding the
+  // image, for an image no smaller than min_x * min_y. Less than
+  // width * height when the image is scaled down while it's decoded.
+  uint64_t peak_pixels;
+};
+
+// A decoder for one image format.
+struct image_decoder {
+  const char *name;
+
+  // Whether the file starts with this format's magic bytes.
+  bool (*matches)(const unsigned char *data, size_t len);
+
+  // Read the image's size from its headers, without decoding it. Returns
+  // false if the headers are damaged or truncated. Null if iqdb was built
+  // without support for the format.
+  bool (*probe)(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info);
+
+  // Decode the image to a truecolor image, scaled down while decoding as far
+  // as the format allows without getting smaller than min_x * min_y. A
+  // format may only scale images down when they'd be over the limits
+  // otherwise. Returns null if the image couldn't be decoded. Null if iqdb
+  // was built without support for the format.
+  RawImage (*decode)(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits);
+};
+
+// The decoder for the format of the given file, or null if the format isn't
+// recognized.
+const image_decoder *find_decoder(const unsigned char *data, size_t len);
+
+}
+
+#endif
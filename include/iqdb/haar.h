@@ -51,6 +51,7 @@ typedef struct valStruct_ {
 
 void transform(Unit *a, Unit *b, Unit *c);
 void transformChar(unsigned char *c1, unsigned char *c2, unsigned char *c3, Unit *a, Unit *b, Unit *c);
+void transformPixels(const int *const *rows, Unit *a, Unit *b, Unit *c);
 int calcHaar(Unit *cdata1, Unit *cdata2, Unit *cdata3, Idx *sig1, Idx *sig2, Idx *sig3, double *avgl);
 
 }
@@ -2,7 +2,9 @@
 #define HAAR_SIGNATURE_H
 
 #include <string>
+#include <string_view>
 #include <iqdb/haar.h>
+#include <iqdb/resizer.h>
 
 namespace iqdb {
 
@@ -16,7 +18,7 @@ struct HaarSignature {
   HaarSignature() {};
   explicit HaarSignature(lumin_t avglf, signature_t sig);
   static HaarSignature from_hash(const std::string hash);
-  static HaarSignature from_file_content(const std::string blob);
+  static HaarSignature from_file_content(std::string_view blob, const decode_limits& limits = {});
 
   std::string to_string() const;
   std::string to_json() const;
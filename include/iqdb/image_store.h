@@ -0,0 +1,74 @@
+#ifndef IQDB_IMAGE_STORE_H
+#define IQDB_IMAGE_STORE_H
+
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <iqdb/haar_signature.h>
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+// A model representing an image signature stored in the database.
+struct Image {
+  iqdbId id;             // The internal IQDB ID.
+  postId post_id;        // The external (Danbooru) post ID.
+  std::string md5;       // MD5 hash of current image.
+  HaarSignature haar;    // With the coefficients of each channel sorted.
+};
+
+// An image to add with IQDB::addImages().
+struct NewImage {
+  postId post_id;
+  std::string md5;
+  HaarSignature signature;
+};
+
+// The outcome of adding one image to the index.
+struct AddedImage {
+  int id;                            // The internal IQDB id, or -1 if the post id is taken, or -2 if the md5 is.
+  std::optional<iqdbId> replaced_id; // The internal IQDB id of the image it replaced, if any.
+};
+
+// A change to the database, made to the in-memory index first and then
+// applied to the store with ImageStore::applyWrites().
+struct QueuedWrite {
+  enum { add, remove } type;
+  iqdbId id;                 // The image's internal IQDB id, chosen by the caller.
+  postId post_id;
+  std::string md5;           // Only for adds.
+  HaarSignature signature;   // Only for adds.
+};
+
+// Where IQDB keeps its images on disk. The in-memory index is the only thing
+// that reads them, so a store only has to add and remove images by their
+// iqdb id, and play them all back at startup. IQDB checks the post id and
+// md5 of every image before it's added, and picks its iqdb id.
+class ImageStore {
+public:
+  virtual ~ImageStore() = default;
+
+  // Get number of images
+  virtual int getImgCount() const noexcept = 0;
+  // Get MAX post id
+  virtual postId getMaxPostId() const noexcept = 0;
+  // Get MAX internal IQDB id
+  virtual iqdbId getMaxId() const noexcept = 0;
+  // Get an image by its internal IQDB id, if it exists.
+  virtual std::optional<Image> getImageById(iqdbId id) = 0;
+
+  // Apply writes, in order, all or nothing. An add that conflicts with an
+  // image already in the store means the store and the index have drifted
+  // apart, so nothing is applied and a store_conflict naming every
+  // conflicting add is thrown.
+  virtual void applyWrites(const std::vector<QueuedWrite>& writes) = 0;
+
+  // Call a function for each image in the store, in id order.
+  virtual void eachImage(std::function<void (const Image&)>) = 0;
+};
+
+}
+
+#endif
@@ -24,15 +24,27 @@
 #ifndef IMGDBASE_H
 #define IMGDBASE_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #include <iqdb/haar.h>
 #include <iqdb/haar_signature.h>
+#include <iqdb/image_store.h>
 #include <iqdb/imglib.h>
+#include <iqdb/log_db.h>
+#include <iqdb/MD5.h>
 #include <iqdb/resizer.h>
+#include <iqdb/snapshot.h>
 #include <iqdb/sqlite_db.h>
+#include <iqdb/thread_pool.h>
 #include <iqdb/types.h>
 
 namespace iqdb {
@@ -59,10 +71,9 @@ DEFINE_ERROR(fatal_error, base_error)
 DEFINE_ERROR(simple_error, base_error)
 DEFINE_ERROR(param_error, simple_error) // An argument was invalid, e.g. non-existent image ID.
 DEFINE_ERROR(image_error, simple_error) // Could not successfully extract image data from the given file.
-
-typedef struct {
-  Score v[3];
-} lumin_native;
+DEFINE_ERROR(snapshot_error, simple_error) // A snapshot file couldn't be written, or was missing, stale or damaged.
+DEFINE_ERROR(database_error, simple_error) // A read or write to the image store failed.
+DEFINE_ERROR(store_conflict, database_error) // A write conflicted with an image already in the store, so none of its batch was applied.
 
 struct sim_value {
   imageId id;
@@ -74,44 +85,387 @@ struct sim_value {
   }
 };
 
-struct image_info {
-  image_info() {}
-  image_info(imageId i, const lumin_native &a) : id(i), avgl(a) {}
-  imageId id;
-  lumin_native avgl;
+// The in-memory image table, indexed by iqdb id. The rows are stored in
+// fixed-size chunks, with one column per field in each chunk so the
+// luminance pass of a query can stream through each channel.
+//
+// Like bucket_set, copying a table is cheap: the copies share their chunks,
+// and a chunk is only copied when one of them changes it.
+class image_table {
+public:
+  static constexpr size_t chunk_size = 4096;
+
+  struct chunk {
+    postId post_id[chunk_size]; // The post id of each image.
+    Score avgl[3][chunk_size];  // The YIQ DC coefficients of each image. avgl[0] == 0 marks an unused or deleted id.
+  };
+
+  size_t size() const noexcept { return chunks_.size() * chunk_size; }
+  size_t chunks() const noexcept { return chunks_.size(); }
+  const chunk& chunkAt(size_t i) const { return *chunks_[i]; }
+
+  // Grow the table to hold at least `n` rows. New rows are unused.
+  void resize(size_t n);
+  void clear();
+
+  postId postIdOf(imageId iqdb_id) const { return chunks_.at(iqdb_id / chunk_size)->post_id[iqdb_id % chunk_size]; }
+  bool isDeleted(imageId iqdb_id) const { return !chunks_.at(iqdb_id / chunk_size)->avgl[0][iqdb_id % chunk_size]; }
+
+  // Fill in the row for an image, or mark it as deleted. The table must
+  // already be large enough. While the table isn't shared with a copy, set()
+  // may be called from several threads at once for different ids.
+  void set(imageId iqdb_id, postId post_id, const HaarSignature& haar);
+  void erase(imageId iqdb_id);
+
+  void save(snapshot_writer& writer) const;
+  void load(snapshot_reader& reader);
+
+private:
+  // The chunk holding `iqdb_id`, copied first if it's shared with another table.
+  chunk& mutableChunk(imageId iqdb_id);
+
+  std::vector<std::shared_ptr<chunk>> chunks_;
+};
+
+// The md5 and signature of each image, indexed by iqdb id, so that query
+// results can be rendered without going to the store. Kept apart from
+// image_table so that queries don't stream through it while scoring, but
+// chunked and shared between copies in the same way. Signatures take 264
+// bytes per image, so they're only kept if keepsSignatures().
+class image_metadata {
+public:
+  static constexpr size_t chunk_size = 1024;
+
+  explicit image_metadata(bool keep_signatures = true) : keep_signatures_(keep_signatures) {}
+
+  bool keepsSignatures() const noexcept { return keep_signatures_; }
+  size_t size() const noexcept { return md5s_.size() * chunk_size; }
+
+  // Grow the table to hold at least `n` rows.
+  void resize(size_t n);
+  void clear();
+
+  // The md5 of an image. All zeros if it wasn't a valid md5.
+  const md5_digest& md5Of(iqdbId iqdb_id) const { return md5s_.at(iqdb_id / chunk_size)->md5[iqdb_id % chunk_size]; }
+
+  // The signature of an image, or null if signatures aren't kept.
+  const HaarSignature* signatureOf(iqdbId iqdb_id) const;
+
+  // Fill in the row for an image. Like image_table::set(), may be called
+  // from several threads at once for different ids while the table isn't
+  // shared with a copy.
+  void set(iqdbId iqdb_id, const md5_digest& md5, const HaarSignature& haar);
+
+  void save(snapshot_writer& writer) const;
+  void load(snapshot_reader& reader);
+
+private:
+  struct md5_chunk {
+    md5_digest md5[chunk_size];
+  };
+
+  struct signature_chunk {
+    HaarSignature haar[chunk_size];
+  };
+
+  bool keep_signatures_;
+  std::vector<std::shared_ptr<md5_chunk>> md5s_;
+  std::vector<std::shared_ptr<signature_chunk>> signatures_; // Empty unless keep_signatures_.
+};
+
+// A map from post ids or md5s to the iqdb ids of the images in the index.
+// The keys are hashed into a fixed number of shards, each a sorted array
+// shared between copies of the map until one of them changes it, so that
+// copying a map is cheap and changing one key only copies one shard.
+template <typename Key>
+class id_map {
+public:
+  static constexpr size_t shard_count = 4096;
+
+  struct entry {
+    Key key;
+    iqdbId id;
+  };
+
+  id_map() : shards_(shard_count) {}
+
+  std::optional<iqdbId> find(const Key& key) const;
+
+  // Add a key, or point it at a new id.
+  void insert(const Key& key, iqdbId iqdb_id);
+
+  // Remove a key, if it still points at `iqdb_id`.
+  void erase(const Key& key, iqdbId iqdb_id);
+
+  // Replace the contents of the map with `entries`. Of several entries with
+  // the same key, one is kept.
+  void assign(std::vector<entry> entries);
+
+  void save(snapshot_writer& writer) const;
+  void load(snapshot_reader& reader);
+
+private:
+  using shard = std::vector<entry>; // Sorted by key.
+
+  // Null if the shard is empty.
+  std::vector<std::shared_ptr<shard>> shards_;
 };
 
 typedef std::vector<sim_value> sim_vector;
 typedef Idx sig_t[NUM_COEFS];
 
+// Scratch memory for scoring one shard of a query.
+struct query_arena {
+  std::vector<Score> scores;      // The score of each image in the shard, or of each query's tile of images.
+  std::vector<sim_vector> heaps;  // The best results so far of each query, as a max-heap.
+};
+
+// A pool of query arenas, reused from one query to the next so that the
+// query path doesn't allocate and page in a score for every image on each
+// call. Arenas only ever grow, so once they're big enough for the index they
+// stay that way.
+class arena_pool {
+public:
+  // An arena borrowed from the pool. It goes back to the pool when the lease
+  // is destroyed.
+  class lease {
+  public:
+    lease(arena_pool& pool, std::unique_ptr<query_arena> arena) : pool_(&pool), arena_(std::move(arena)) {}
+    lease(lease&&) = default;
+    lease& operator=(lease&&) = default;
+    ~lease() { if (arena_) pool_->release(std::move(arena_)); }
+
+    // The first `n` scores of the arena, grown if needed. The scores hold
+    // whatever the last query left in them.
+    Score* scores(size_t n);
+
+    // The first `n` heaps of the arena, emptied, with room for `numres`
+    // results each, or for the `shard_size` images of the shard if that's
+    // fewer.
+    std::vector<sim_vector>& heaps(size_t n, size_t numres, size_t shard_size);
+
+  private:
+    arena_pool* pool_;
+    std::unique_ptr<query_arena> arena_;
+  };
+
+  struct stats {
+    size_t arenas;      // Number of arenas created.
+    size_t allocations; // Number of times an arena was created or grown.
+    size_t bytes;       // Total size of all arenas.
+  };
+
+  lease acquire();
+  stats getStats() const;
+
+private:
+  void release(std::unique_ptr<query_arena> arena);
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<query_arena>> free_; // Arenas not lent out. Guarded by mutex_.
+  std::atomic<size_t> arenas_ = 0;
+  std::atomic<size_t> allocations_ = 0;
+  std::atomic<size_t> bytes_ = 0;
+};
+
+// Tunable settings for an IQDB instance.
+struct IQDBOptions {
+  size_t query_threads = 1;       // Number of shards each query is split into, scored in parallel.
+  size_t load_threads = 0;        // Number of threads that build the index at startup. 0 means one per CPU.
+  std::string snapshot_filename;  // File to load the index from at startup, and save it to after loading it from the database.
+  bool cache_signatures = true;   // Keep every image's signature in memory for rendering query results, instead of reading it from the store.
+  std::string storage = "sqlite"; // How the database is stored: "sqlite" for a SqliteDB, or "log" for a LogDB.
+  SqliteOptions sqlite;           // PRAGMAs to open an SQLite database with.
+  LogOptions log;                 // Settings for a log store.
+  size_t commit_delay_ms = 0;     // Queue writes to the store and commit them in one transaction at most this long after the first. 0 commits each call before it returns.
+  size_t commit_rows = 1000;      // Commit queued writes early once this many are waiting.
+};
+
+// An image in the index, as returned by IQDB::getImage().
+struct IndexedImage {
+  iqdbId id;
+  postId post_id;
+  std::string md5;
+  HaarSignature haar;
+};
+
+// The image database and its in-memory index.
+//
+// Queries and the other read-only calls may run on any number of threads at
+// once, and never wait for writers: each one reads the version of the index
+// that was current when it started. Calls that change the database wait for
+// each other, then publish a new version of the index. A new version shares
+// everything it didn't change with the previous one, and a version is freed
+// when the last query reading it finishes.
+//
+// With `commit_delay_ms` set, a change is published to the index right away
+// but only queued for the store, and a background thread commits the queue in
+// one transaction once it's that old or `commit_rows` long. Changes still in
+// the queue are lost if the process dies without calling flush().
 class IQDB {
 public:
-  IQDB(std::string filename = ":memory:");
+  // Open the database at `filename`. If `options.snapshot_filename` is
+  // given, the index is loaded from that snapshot when it's up to date with
+  // the database, and saved to it after loading from the database otherwise.
+  IQDB(std::string filename = ":memory:", const IQDBOptions& options = {});
+
+  // Commits any queued writes. Errors are logged, not thrown; call flush()
+  // first to handle them.
+  ~IQDB();
   
   // Image queries.
   sim_vector queryFromSignature(const HaarSignature& img, size_t numres = 10);
-  sim_vector queryFromBlob(const std::string blob, int numres = 10);
+  
+  // Run many queries together, sharing each pass over the index between up
+  // to max_batch_queries of them. Returns the results of each query, in
+  // order; they're the same as queryFromSignature() would return.
+  std::vector<sim_vector> queryFromSignatures(const std::vector<HaarSignature>& signatures, size_t numres = 10);
+  sim_vector queryFromBlob(std::string_view blob, int numres = 10);
   
   // Stats.
   size_t getImgCount();
   postId getLastPostId();
+  size_t getQueuedWrites();
+  size_t getStoreConflicts() const { return store_conflicts_; }
+  arena_pool::stats getArenaStats() const { return arenas_.getStats(); }
   bool isDeleted(imageId id); // XXX id is the iqdb id
   
   // DB maintenance.
   void addImage(imageId id, const std::string& md5, const HaarSignature& signature, bool replace_img = true);
-  std::optional<Image> getImage(imageId post_id);
-  std::optional<Image> getImageByMD5(const std::string& md5);
+  
+  // Add or replace many images in one transaction and one update of
+  // the index. Returns the error for each image, or an empty string for each
+  // image that was added.
+  std::vector<std::string> addImages(const std::vector<NewImage>& images);
+  
+  // Look up an image in the index. Only goes to the store for the signature
+  // when signatures aren't cached in memory.
+  std::optional<IndexedImage> getImage(postId post_id);
+  std::optional<IndexedImage> getImageByMD5(const std::string& md5);
   bool removeImage(imageId id);
   bool removeImageByMD5(const std::string& md5);
   void loadDatabase(std::string filename);
+  void saveSnapshot();
+  
+  // Commit the queued writes to the store now, in one transaction. If it fails,
+  // the writes stay queued and the error is thrown. If the store refuses the
+  // batch because it conflicts with its images, the writes are committed one
+  // at a time instead, and the ones it still refuses are dropped.
+  void flush();
+  
+  // Bucket maintenance. Ids added to the index go into a delta segment, and
+  // removed images are only tombstoned, so the buckets must be merged and
+  // compacted from time to time. mergeBuckets() reads the current version of
+  // the index without blocking anything; installBuckets() publishes the
+  // merged buckets, keeping whatever changed in between. It only fails if
+  // another merge was installed first.
+  size_t getPendingBucketIds();
+  size_t getPendingRemovals();
+  bucket_merge mergeBuckets();
+  bool installBuckets(bucket_merge merge);
   
 private:
-  void addImageInMemory(imageId iqdb_id, imageId post_id, const HaarSignature& signature);
+  // One version of the in-memory index. Never changed once it's published.
+  struct index_state {
+    image_table images;
+    image_metadata metadata;
+    id_map<postId> post_ids;
+    id_map<md5_digest> md5s;
+    bucket_set buckets;
+  };
+  
+  // The current version of the index.
+  std::shared_ptr<const index_state> state() const;
+  
+  // Apply func to a copy of the current version, then publish the copy.
+  // The caller must hold write_mutex_.
+  template <typename F>
+  void update(F func);
+  
+  // Like update(), for changes to the database: func(state, writes) changes
+  // the copy and appends the matching writes to the store, which are committed
+  // before the copy is published, or queued after it's published in group
+  // commit mode. The caller must hold write_mutex_.
+  template <typename F>
+  void write(F func);
+  
+  // Add or replace an image in `state`, checking that its post id and md5
+  // are unique, and append the writes to make the same change to the store.
+  // Returns the new iqdb id, or -1 if the post id is taken (and replace_img
+  // is false), or -2 if another post has the same md5.
+  AddedImage addImageTo(index_state& state, const NewImage& image, bool replace_img, std::vector<QueuedWrite>& writes);
+  
+  void queueWrites(std::vector<QueuedWrite>&& writes);
+  
+  // Runs on commit_thread_, flushing the queue when it's due.
+  void commitLoop();
+  
+  static void addImageInMemory(index_state& state, imageId iqdb_id, imageId post_id, const std::string& md5, const HaarSignature& signature);
+  static void removeImageInMemory(index_state& state, imageId iqdb_id);
+
+  // An empty version of the index, set up with this instance's options.
+  std::shared_ptr<index_state> emptyState() const;
+
+  // The image with the given iqdb id, filled in from `state`. Goes to the store
+  // for whatever `state` doesn't have: the signature, if signatures aren't
+  // cached, or the md5, if it wasn't a valid md5.
+  std::optional<IndexedImage> indexedImage(const index_state& state, iqdbId iqdb_id);
+  
+  // Must be called with write_mutex_ held.
+  bool removeImageLocked(imageId post_id);
+  
+  void loadSnapshot(index_state& state);
+  void loadImages(index_state& state);
+  
+  // Score the images in the iqdb id range [begin, end) and return the best
+  // `numres` of them, with unscaled scores and iqdb ids instead of post ids.
+  sim_vector queryShard(const index_state& state, const HaarSignature& signature, size_t numres, iqdbId begin, iqdbId end);
+  
+  // Like queryShard(), for several queries at once. The range is scored one
+  // tile of batch_tile_size ids at a time, so that each tile of the image
+  // table is read once for every query and the scores stay in cache.
+  std::vector<sim_vector> queryShardBatch(const index_state& state, const std::vector<HaarSignature>& signatures, size_t numres, iqdbId begin, iqdbId end);
+  
+  // Split the iqdb id range of `state` into shards, and call func(begin, end)
+  // for each: the first on this thread, the rest on the query pool. Returns
+  // the results of each shard.
+  template <typename F>
+  auto runShards(const index_state& state, F func) -> std::vector<decltype(func(0, 0))>;
+  
+  // Queries smaller than this many images per shard aren't worth splitting.
+  static const size_t min_shard_size = 65536;
+  
+  static const size_t max_batch_queries = 16;
+  static const size_t batch_tile_size = 16384;
+  
+  std::shared_ptr<const index_state> state_; // Only accessed with std::atomic_load and std::atomic_store.
+  std::mutex write_mutex_;                    // Held by every call that changes the database.
+  std::unique_ptr<ImageStore> store_;
+  std::atomic<postId> last_post_id = 0;
+  std::atomic<size_t> image_count_ = 0;       // Counts queued writes too, unlike ImageStore::getImgCount().
+  std::atomic<size_t> store_conflicts_ = 0;   // Writes the index made but the store refused with a store_conflict.
+  iqdbId next_id_ = 1;                        // The iqdb id of the next image added. Guarded by write_mutex_.
+  
+  std::string snapshot_filename_;
+  size_t query_threads_;
+  size_t load_threads_;
+  bool cache_signatures_;
+  std::string storage_;
+  SqliteOptions sqlite_options_;
+  LogOptions log_options_;
+  std::unique_ptr<ThreadPool> query_pool_; // Runs all shards except the first, which runs on the calling thread.
+  arena_pool arenas_;                      // Scratch memory for the shards of queries.
   
-  std::vector<image_info> m_info;
-  std::unique_ptr<SqliteDB> sqlite_db_;
-  bucket_set imgbuckets;
-  postId last_post_id = 0;
+  std::mutex commit_mutex_;                   // Held while flushing, so that batches are committed in order.
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  std::vector<QueuedWrite> queued_writes_;    // Writes waiting to be committed. Guarded by queue_mutex_.
+  std::vector<QueuedWrite> committing_;       // Writes being committed by flush(). Changed only with both mutexes held.
+  std::chrono::steady_clock::time_point first_queued_; // When the oldest queued write was queued.
+  bool stopping_ = false;                     // Guarded by queue_mutex_.
+  std::chrono::milliseconds commit_delay_;
+  size_t commit_rows_;
+  std::thread commit_thread_;
   
 private:
   void operator=(const IQDB &);
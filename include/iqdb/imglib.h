@@ -24,8 +24,17 @@
 #ifndef IMGDBLIB_H
 #define IMGDBLIB_H
 
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <functional>
+#include <memory>
+#include <vector>
+
 #include <iqdb/haar.h>
+#include <iqdb/snapshot.h>
 #include <iqdb/sqlite_db.h>
+#include <iqdb/streamvbyte.h>
 
 namespace iqdb {
 
@@ -69,20 +78,234 @@ constexpr static auto imgBin = ImgBin<NUM_PIXELS>();
 
 using bucket_t = std::vector<uint32_t>;
 
-class bucket_set {
+// A sorted run of image ids inside a bucket.
+struct posting_list {
+  const uint32_t* first = nullptr;
+  const uint32_t* last = nullptr;
+
+  const uint32_t* begin() const noexcept { return first; }
+  const uint32_t* end() const noexcept { return last; }
+  size_t size() const noexcept { return static_cast<size_t>(last - first); }
+  bool empty() const noexcept { return first == last; }
+};
+
+// A block of up to posting_segment::block_size ids from one bucket.
+struct posting_block {
+  uint64_t offset; // Offset of the encoded ids in posting_segment's data.
+  uint32_t first;  // The first id in the block. The ids are encoded as gaps from this.
+  uint32_t count;  // Number of ids in the block.
+};
+
+// The compressed posting lists of every bucket. Each bucket is a sorted list
+// of ids split into blocks, and each block is Stream VByte encoded as gaps
+// from the block's first id. The block table lets a query skip straight to
+// the block holding a given id. A segment is never changed once it's built.
+class posting_segment {
 public:
-  bucket_t& at(int col, int coef);
-  void add(const HaarSignature &sig, imageId iqdb_id);
-  void remove(const HaarSignature &sig, imageId iqdb_id);
-  void eachBucket(const HaarSignature &sig, std::function<void(bucket_t&)> func);
+  static constexpr size_t block_size = 128; // A multiple of 4, so blocks decode in whole SIMD groups.
+
+  posting_segment();
+
+  // Append the next bucket, holding the `n` sorted ids in `ids`. Every bucket
+  // must be appended in order, then finish() called once.
+  void append(const uint32_t* ids, size_t n);
+  void finish();
+  void reserve(size_t bytes);
+
+  size_t dataSize() const noexcept { return data_.size(); }
+  size_t buckets() const noexcept { return lengths_.size(); }
+  size_t size(size_t b) const noexcept { return lengths_[b]; }
+
+  // Decode all the ids of bucket `b` into `out`.
+  void decode(size_t b, std::vector<uint32_t>& out) const;
+
+  // Write the segment to a snapshot, or replace it with one read from a snapshot.
+  void save(snapshot_writer& writer) const;
+  void load(snapshot_reader& reader);
+
+  // Call func(id) for each id in bucket `b` in the range [begin, end), in order.
+  template <typename F>
+  void each(size_t b, uint32_t begin, uint32_t end, F func) const {
+    const posting_block* first = blocks_.data() + block_offsets_[b];
+    const posting_block* last = blocks_.data() + block_offsets_[b + 1];
+    auto it = std::upper_bound(first, last, begin, [](uint32_t id, const posting_block& block) { return id < block.first; });
+    uint32_t ids[block_size];
+
+    if (it != first)
+      --it;
+
+    for (; it != last && it->first < end; ++it) {
+      streamvbyte_decode(data_.data() + it->offset, it->count, it->first, ids);
+
+      for (uint32_t i = 0; i < it->count; i++) {
+        if (ids[i] >= end)
+          return;
+        if (ids[i] >= begin)
+          func(ids[i]);
+      }
+    }
+  }
+
+private:
+  std::vector<uint8_t> data_;
+  std::vector<posting_block> blocks_;
+  std::vector<size_t> block_offsets_; // Bucket `b` owns blocks [block_offsets_[b], block_offsets_[b + 1]).
+  std::vector<uint32_t> lengths_;     // Number of ids in each bucket.
+};
+
+// The ids of removed images, as a bitmap split into pages. Like the delta
+// segment, copies share their pages, and adding an id only copies the one
+// page it's in.
+class tombstone_set {
+public:
+  static constexpr size_t page_bits = 4096;
+
+  bool contains(imageId id) const noexcept;
+  void insert(imageId id);
+
+  size_t size() const noexcept { return size_; }
+  bool empty() const noexcept { return size_ == 0; }
+
+  // The ids in this set that aren't in `earlier`, a copy of this set taken
+  // before more ids were added to it. Pages the two still share are skipped
+  // without being read.
+  tombstone_set minus(const tombstone_set& earlier) const;
 
 private:
+  using page = std::bitset<page_bits>;
+
+  std::vector<std::shared_ptr<page>> pages_; // Empty pages may be null.
+  size_t size_ = 0;
+};
+
+// A frozen segment merged from one version of a bucket_set, along with what
+// bucket_set::install() needs to carry over the changes made to the set while
+// it was merged.
+struct bucket_merge {
+  std::unique_ptr<posting_segment> segment;
+  uint64_t base = 0;        // The version of the frozen segment it was merged from.
+  uint64_t version = 0;     // The version of the set it was merged from.
+  std::vector<bool> merged; // The ids that were in the delta segment, by id.
+  tombstone_set removed;    // The tombstones it dropped.
+};
+
+// The ids in one bucket: the ids in the frozen segment plus the sorted run of
+// ids added since the last merge.
+struct bucket_ref {
+  const posting_segment* frozen;
+  size_t index;
+  posting_list delta;
+
+  bool empty() const noexcept { return frozen->size(index) == 0 && delta.empty(); }
+
+  // Call func(id) for each id in the range [begin, end).
+  template <typename F>
+  void each(uint32_t begin, uint32_t end, F func) const {
+    frozen->each(index, begin, end, func);
+
+    auto first = std::lower_bound(delta.begin(), delta.end(), begin);
+    auto last = std::lower_bound(first, delta.end(), end);
+
+    for (auto it = first; it != last; ++it) {
+      func(*it);
+    }
+  }
+};
+
+// An inverted index from Haar coefficients to the ids of the images that
+// have them. Most ids live in a frozen posting_segment. Ids added since the
+// last merge live in a small mutable delta segment, which is merged into a
+// new frozen segment once it grows large enough.
+//
+// Removing an image only records a tombstone. Its ids stay in the buckets,
+// where queries skip them as deleted, until the next merge drops them.
+//
+// Copying a bucket_set is cheap: the copies share the frozen segment and the
+// pages of the delta segment, and a page is only copied when one of them
+// changes it. Changing one copy never touches the others, so a copy may be
+// read from other threads while the original is changed.
+class bucket_set {
+public:
   static const size_t n_colors  = 3;                     // 3 color channels (YIQ)
   static const size_t n_signs   = 2;                     // 2 Haar coefficient signs (positive and negative)
   static const size_t n_indexes = NUM_PIXELS*NUM_PIXELS; // 16384 Haar matrix indexes (128*128)
+  static const size_t n_buckets = n_colors*n_signs*n_indexes; // 3 * 2 * 16384 = 98304 total buckets
+
+  // The index of the bucket for a coefficient in a color channel.
+  static size_t index(int color, int coef);
+
+  bucket_set();
+
+  bucket_ref at(int color, int coef) const;
+  void add(const HaarSignature &sig, imageId iqdb_id);
+  void remove(imageId iqdb_id);
+
+  // Number of ids in the delta segment.
+  size_t deltaSize() const noexcept { return delta_size_; }
+
+  // Number of removed images still in the buckets.
+  size_t removedSize() const noexcept { return removed_.size(); }
+
+  // Build a new frozen segment holding every id in the set, minus removed
+  // images. Usually run on a copy of the set, so that the set itself can
+  // keep changing while the merge runs.
+  bucket_merge merge() const;
 
-  // 3 * 2 * 16384 = 98304 total buckets
-  bucket_t buckets[n_colors][n_signs][n_indexes];
+  // Write the set to a snapshot, or replace it with one read from a
+  // snapshot. The set must be fully merged before it's saved.
+  void save(snapshot_writer& writer) const;
+  void load(snapshot_reader& reader);
+
+  // Replace the frozen segment with a merged one. Ids added and images
+  // removed since the merge was taken stay in the delta segment and the
+  // tombstones; everything else in them is dropped.
+  //
+  // Returns false, and changes nothing, if another merge was installed since
+  // this one was taken.
+  bool canInstall(const bucket_merge& merge) const noexcept { return merge.base == frozen_version_; }
+  bool install(bucket_merge merge);
+
+  // Replace the whole set with a segment built elsewhere.
+  void reset(posting_segment segment);
+
+  // Call func(b) with the index of each bucket holding the signature.
+  static void eachBucket(const HaarSignature &sig, std::function<void(size_t)> func);
+
+private:
+  static const size_t page_size = 256; // Buckets per page of the delta segment.
+  static const size_t n_pages = n_buckets / page_size;
+
+  // A page of delta buckets. Empty buckets may be null.
+  using delta_page = std::array<std::shared_ptr<bucket_t>, page_size>;
+
+  // The delta bucket `b`, or null if it's empty.
+  const bucket_t* delta(size_t b) const;
+
+  // The delta bucket `b`, copied first if it's shared with another set.
+  bucket_t& mutableDelta(size_t b);
+
+  std::shared_ptr<const posting_segment> frozen_;
+  std::vector<std::shared_ptr<delta_page>> delta_; // Empty pages may be null.
+  size_t delta_size_ = 0;
+  tombstone_set removed_;
+  uint64_t version_ = 0; // Incremented on every add() or remove().
+  uint64_t frozen_version_ = 0; // The version the frozen segment was merged from.
+};
+
+// Builds the buckets of many images from several threads at once. Each
+// thread adds images to its own partial bucket lists, in increasing id
+// order, and build() merges the partial lists of every thread.
+class bucket_builder {
+public:
+  explicit bucket_builder(size_t threads);
+
+  void add(size_t thread, const HaarSignature &sig, imageId iqdb_id);
+
+  // Merge the partial lists into one segment, freeing them as it goes.
+  posting_segment build();
+
+private:
+  std::vector<std::vector<bucket_t>> partial_; // Indexed by [thread][bucket].
 };
 
 }
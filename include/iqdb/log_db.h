@@ -0,0 +1,112 @@
+#ifndef IQDB_LOG_DB_H
+#define IQDB_LOG_DB_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <iqdb/image_store.h>
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+struct log_record; // One record in the log. Defined in log_db.cpp.
+
+// Tunable log store settings.
+struct LogOptions {
+  bool sync = true;                   // fdatasync() the log after every batch of writes. Without it, a power loss can undo the last few batches.
+  size_t compact_min_records = 65536; // Never compact a log with fewer dead records than this.
+};
+
+// An image store kept in an append-only log of fixed-size records.
+//
+// Adding an image appends a record with its post id, md5 and signature, and
+// removing one appends a tombstone with its id, so every batch of writes is
+// one sequential write to the end of the file. The last record of a batch is
+// marked, and a batch that was cut short by a crash is dropped when the log
+// is opened. Once the log holds more dead records (tombstones, and the
+// images they removed) than live ones, it's compacted on a background
+// thread: the live records are copied to a new log, which is renamed over
+// the old one. Writes only wait for the end of a compaction, while the
+// batches written during it are copied over too.
+//
+// The offset of each live image's record is kept in memory, by iqdb id.
+// Startup reads the log through a memory map, twice: once to find the live
+// records, and once to play them back in id order.
+//
+// Logs are only readable on a machine with the same byte order as the one
+// that wrote them.
+class LogDB : public ImageStore {
+public:
+  LogDB(const std::string& path, const LogOptions& options = {});
+  ~LogDB() override;
+
+  int getImgCount() const noexcept override { return image_count_; }
+  postId getMaxPostId() const noexcept override { return max_post_id_; }
+  iqdbId getMaxId() const noexcept override { return max_id_; }
+  std::optional<Image> getImageById(iqdbId id) override;
+
+  // Appends the writes as one batch. Throws store_conflict, without writing
+  // anything, if an add's id is already in the log or its md5 isn't valid.
+  void applyWrites(const std::vector<QueuedWrite>& writes) override;
+
+  void eachImage(std::function<void (const Image&)>) override;
+
+  // Rewrite the log with only the live records, now. This normally happens
+  // on its own, in the background.
+  void compact();
+
+private:
+  // Read the log, drop any incomplete batch from its end, and find the live
+  // records.
+  void replay();
+
+  // Apply a record that's been written to the log at `offset` to the
+  // in-memory state. Returns true if it removed the largest post id or id.
+  bool apply(const log_record& r, uint64_t offset);
+
+  // Wake up the compaction thread if the log has enough dead records. Must
+  // be called with log_mutex_ held.
+  void maybeCompact();
+
+  // Runs on compact_thread_. Errors are logged, not thrown, since the
+  // writes that triggered the compaction were already committed.
+  void compactLoop();
+
+  // Recompute the largest post id and id, after the image that had one of
+  // them was removed.
+  void refreshMaxIds();
+
+  bool isLive(iqdbId id) const noexcept { return id < offsets_.size() && offsets_[id] != 0; }
+
+  std::string path_;
+  LogOptions options_;
+  int fd_ = -1;
+
+  // A mutex around the log
+  std::mutex log_mutex_;
+
+  uint64_t size_ = 0;                  // Bytes of complete batches in the log. Guarded by log_mutex_.
+  std::vector<uint64_t> offsets_;      // The offset of each live image's record, by iqdb id, or 0. Guarded by log_mutex_.
+  std::vector<postId> post_ids_;       // The post id of each live image, by iqdb id. Guarded by log_mutex_.
+
+  std::atomic<int> image_count_ = 0;
+  std::atomic<postId> max_post_id_ = 0;
+  std::atomic<iqdbId> max_id_ = 0;
+
+  std::mutex compact_mutex_;           // Held for a whole compaction, so only one runs at a time.
+  std::condition_variable compact_cv_; // Wakes up compact_thread_. Used with log_mutex_.
+  bool compact_requested_ = false;     // Guarded by log_mutex_.
+  std::atomic<bool> stopping_ = false; // Set by the destructor; stops a compaction that's running.
+  std::thread compact_thread_;
+};
+
+}
+
+#endif
@@ -1,6 +1,6 @@
 /***************************************************************************\
-    resizer.h - Image resizer using libgd, using pre-scaled images
-		from libjpeg/libpng to be faster and use less memory.
+    resizer.h - Image resizer using libgd, using images pre-scaled
+		by their decoders to be faster and use less memory.
 
     Copyright (C) 2008 piespy@gmail.com
 
@@ -22,6 +22,7 @@
 #ifndef IQDB_RESIZER_H
 #define IQDB_RESIZER_H
 
+#include <cstdint>
 #include <gd.h>
 #include <memory>
 
@@ -29,9 +30,24 @@ namespace iqdb {
 
 typedef std::unique_ptr<gdImage, decltype(&gdImageDestroy)> RawImage;
 
+// Limits on the images resize_image_data() will decode, so that one huge or
+// malicious upload can't run the server out of memory.
+struct decode_limits {
+  size_t max_bytes = 100 * 1024 * 1024;  // Largest image file accepted.
+  uint64_t max_image_pixels = 250000000; // Largest image accepted, as width * height. Bounds the time spent decoding.
+  uint64_t max_decode_pixels = 64000000; // Most pixels a decoder may hold in memory at once, after scaling the image down while decoding it.
+};
+
 // Take image data at given memory location and length, and resize
-// to thu_x*thu_y and return it.
-RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y);
+// to thu_x*thu_y and return it. The format is detected from the data, and
+// JPEG, WebP and AVIF images are scaled down while they're decoded, as far as
+// they can be without getting smaller than thu_x*thu_y. PNGs are only scaled
+// down while they're decoded when they'd be over max_decode_pixels at full
+// size.
+//
+// The image's headers are checked against `limits` before anything is
+// decoded, and images over the limits are rejected with an image_error.
+RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y, const decode_limits& limits = {});
 
 }
 
@@ -0,0 +1,20 @@
+#ifndef IQDB_SCORE_KERNELS_H
+#define IQDB_SCORE_KERNELS_H
+
+#include <cstddef>
+#include <iqdb/types.h>
+
+namespace iqdb {
+
+// Compute the luminance (DC coefficient) score of `n` images:
+//
+//   out[i] = sum(weights[0][c] * |avgl[c][i] - query[c]|) for c < num_colors
+//
+// `avgl` holds one contiguous column per color channel. Uses AVX2 or SSE2
+// when the CPU supports it, chosen at runtime, and plain C++ otherwise. All
+// versions give bit-identical results.
+void luminance_scores(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t n);
+
+}
+
+#endif
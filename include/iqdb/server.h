@@ -6,8 +6,20 @@
 
 namespace iqdb {
 
+// Tunable server settings, set by `--name=value` options on the `iqdb http` command line.
+struct ServerOptions {
+  IQDBOptions db;                   // --threads, --load-threads, --cache-signatures, --snapshot, --storage, --commit-*, --sqlite-* and --log-*.
+  size_t signature_threads = 0;     // --signature-threads: threads that hash uploaded images. 0 means one per CPU.
+  size_t signature_queue = 64;      // --signature-queue: images waiting to be hashed before requests get a 503. 0 means no limit.
+  size_t merge_threshold = 1000000; // --merge-threshold: pending bucket ids that trigger a background merge.
+  size_t compact_threshold = 10000; // --compact-threshold: pending removed images that trigger a background merge.
+  int max_query_limit = 1000;       // --max-query-limit: largest `limit` a query can ask for.
+  size_t max_request_bytes = 256 * 1024 * 1024; // --max-request-bytes: largest request body accepted, so that one batch can't take unbounded memory.
+  decode_limits decode;             // --max-image-bytes, --max-image-pixels and --max-decode-pixels.
+};
+
 void help();
-void http_server(const std::string host, const int port, const std::string database_filename);
+void http_server(const std::string host, const int port, const std::string database_filename, const ServerOptions& options = {});
 
 }
 
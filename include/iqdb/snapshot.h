@@ -0,0 +1,119 @@
+#ifndef IQDB_SNAPSHOT_H
+#define IQDB_SNAPSHOT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace iqdb {
+
+// A snapshot is a binary dump of the in-memory index (the image table, the
+// image metadata, the post id and md5 maps, and the merged bucket segment),
+// so that iqdb can start without rebuilding the index from SQLite. It
+// records the row count and max id of the SQLite database it was taken from,
+// so that a stale snapshot can be detected, and a checksum of its contents,
+// so that a damaged one can be.
+//
+// The file is the header followed by a list of arrays. Each array is stored
+// as a 64-bit element count followed by the raw elements, zero-padded to a
+// multiple of 8 bytes. Snapshots are only readable on a machine with the
+// same byte order and struct layout as the one that wrote them.
+struct snapshot_header {
+  char magic[8];         // "IQDBSNAP"
+  uint32_t version;      // snapshot_version
+  uint32_t byte_order;   // 0x01020304, as written by the host
+  uint64_t image_count;  // Number of images in the SQLite database.
+  uint64_t max_id;       // Largest iqdb id in the SQLite database.
+  uint64_t payload_size; // Number of bytes after the header.
+  uint64_t checksum;     // Checksum of the bytes after the header.
+};
+
+// Bump this whenever the layout of the snapshot or of the arrays in it changes.
+const uint32_t snapshot_version = 3;
+
+// A fast, non-cryptographic checksum of `n_words` 64-bit words, chained
+// from `hash`. Start from checksum_seed. Also used by the log store.
+const uint64_t checksum_seed = 0xcbf29ce484222325ULL;
+uint64_t checksum_words(uint64_t hash, const uint8_t* data, size_t n_words);
+
+// Writes a snapshot to a temporary file, then moves it into place on commit().
+class snapshot_writer {
+public:
+  explicit snapshot_writer(const std::string& filename);
+  ~snapshot_writer();
+
+  template <typename T>
+  void write(const T* data, size_t n) {
+    const uint64_t count = n;
+    write_bytes(&count, sizeof(count));
+    write_bytes(data, n * sizeof(T));
+  }
+
+  template <typename T>
+  void write(const std::vector<T>& array) {
+    write(array.data(), array.size());
+  }
+
+  // Write the header, flush the file to disk, and rename it over `filename`.
+  void commit(uint64_t image_count, uint64_t max_id);
+
+private:
+  void write_bytes(const void* data, size_t size);
+
+  std::string filename_;
+  std::string tmp_filename_;
+  FILE* file_;
+  uint64_t payload_size_ = 0;
+  uint64_t checksum_;
+};
+
+// Memory-maps a snapshot, checks its header and checksum, and reads the
+// arrays back out of it in the order they were written.
+class snapshot_reader {
+public:
+  explicit snapshot_reader(const std::string& filename);
+  ~snapshot_reader();
+
+  const snapshot_header& header() const noexcept { return *reinterpret_cast<const snapshot_header*>(map_); }
+
+  template <typename T>
+  void read(std::vector<T>& array) {
+    uint64_t count;
+    read_bytes(&count, sizeof(count));
+
+    if (count > remaining() / sizeof(T))
+      fail("array is larger than the file");
+
+    array.resize(count);
+    read_bytes(array.data(), count * sizeof(T));
+  }
+
+  // Read the next array into `data`, which must hold exactly `n` elements.
+  template <typename T>
+  void read(T* data, size_t n) {
+    uint64_t count;
+    read_bytes(&count, sizeof(count));
+
+    if (count != n)
+      fail("array has the wrong size");
+
+    read_bytes(data, n * sizeof(T));
+  }
+
+private:
+  void validate() const;
+  void read_bytes(void* data, size_t size);
+  size_t remaining() const noexcept { return static_cast<size_t>(end_ - pos_); }
+  [[noreturn]] void fail(const std::string& reason) const;
+
+  std::string filename_;
+  void* map_ = nullptr;
+  size_t map_size_ = 0;
+  const uint8_t* pos_ = nullptr;
+  const uint8_t* end_ = nullptr;
+};
+
+}
+
+#endif
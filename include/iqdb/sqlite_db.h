@@ -1,85 +1,83 @@
 #ifndef IQDB_SQLITE_DB_H
 #define IQDB_SQLITE_DB_H
 
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
-#include <shared_mutex>
 #include <string>
 #include <vector>
 
-#include <sqlite_orm/sqlite_orm.h>
 #include <iqdb/haar_signature.h>
+#include <iqdb/image_store.h>
 #include <iqdb/types.h>
 
+struct sqlite3;
+
 namespace iqdb {
 
-// A model representing an image signature stored in the SQLite database.
-struct Image {
-  iqdbId id;             // The internal IQDB ID.
-  postId post_id;        // The external (Danbooru) post ID.
-  std::string md5;       // MD5 hash of current image.
-  double avglf1;         // The `double avglf[3]` array.
-  double avglf2;
-  double avglf3;
-  std::vector<char> sig; // The `int16_t sig[3][40]` array, stored as a binary blob.
-  
-  HaarSignature haar() const;
+// Tunable SQLite settings, applied with PRAGMAs when the database is opened.
+// https://www.sqlite.org/pragma.html
+struct SqliteOptions {
+  std::string synchronous = "NORMAL";    // OFF, NORMAL, FULL or EXTRA. In WAL mode, NORMAL never corrupts the database, but a power loss can undo the last few commits.
+  int64_t mmap_size = 256 * 1024 * 1024; // Bytes of the database file to read through a memory map.
+  int64_t cache_size = 64 * 1024 * 1024; // Bytes of pages to cache in memory.
 };
 
-// Initialize the database, creating the table if it doesn't exist.
-static auto initStorage(const std::string& path = ":memory:") {
-  using namespace sqlite_orm;
-  
-  auto storage = make_storage(path,
-    make_table("images",
-      make_column("id",       &Image::id, primary_key()),
-      make_column("post_id",  &Image::post_id, unique()),
-      make_column("md5",      &Image::md5, unique()),
-      make_column("avglf1",   &Image::avglf1),
-      make_column("avglf2",   &Image::avglf2),
-      make_column("avglf3",   &Image::avglf3),
-      make_column("sig",      &Image::sig)
-    )
-  );
-  
-  storage.sync_schema();
-  return storage;
-}
-
-// An SQLite database containing a table of image hashes.
-class SqliteDB {
+// An image store backed by an SQLite database containing a table of image
+// hashes.
+//
+// The database is opened once, in WAL mode, and every query is a prepared
+// statement compiled when the database is opened. The image count and the
+// largest ids are kept up to date as images are added and removed, instead
+// of being recomputed with an aggregate on every call.
+class SqliteDB : public ImageStore {
 public:
-  using Storage = decltype(initStorage());
-  
   // Open database at path. Default to a temporary memory-only database.
-  SqliteDB(const std::string& path = ":memory:") : storage_(initStorage(path)) {};
-  
-  // Get number of images
-  int getImgCount();
-  // Get MAX post id
-  postId getMaxPostId();
-  // Get an image from the database, if it exists.
-  std::optional<Image> getImage(postId post_id);
-  // Get an image from the database by input md5, if it exists.
-  std::optional<Image> getImageByMD5(const std::string& md5);
-  
-  // Add the image to the database. Replace the image if it already exists. Returns the internal IQDB id.
-  int addImage(postId post_id, const std::string& md5, HaarSignature signature, bool replace_img = true);
-  
-  // Remove the image from the database.
-  void removeImage(postId post_id);
-  
-  // Call a function for each image in the database.
-  void eachImage(std::function<void (const Image&)>);
-  
+  SqliteDB(const std::string& path = ":memory:", const SqliteOptions& options = {});
+  ~SqliteDB() override;
+
+  int getImgCount() const noexcept override { return image_count_; }
+  postId getMaxPostId() const noexcept override { return max_post_id_; }
+  iqdbId getMaxId() const noexcept override { return max_id_; }
+  std::optional<Image> getImageById(iqdbId id) override;
+
+  // Applies the writes in one transaction. The unique constraints on the
+  // post id and md5 catch any add that conflicts, and roll it all back.
+  void applyWrites(const std::vector<QueuedWrite>& writes) override;
+
+  void eachImage(std::function<void (const Image&)>) override;
+
 private:
+  struct statements;
+
+  // Create the images table in a new database, or bring an old one up to
+  // the current schema version.
+  void migrate();
+
+  // Rewrite a version 1 images table in the version 2 format. Must be called
+  // inside a transaction.
+  void packSignatures();
+
+  // Recompute the largest post id and id, after the image that had one of
+  // them was removed. Both are indexed, so this doesn't scan the table.
+  void refreshMaxIds();
+
+  // Run a statement that returns no rows, such as a PRAGMA.
+  void exec(const std::string& sql);
+
   // The SQLite database.
-  Storage storage_;
-  
+  sqlite3* db_ = nullptr;
+  std::unique_ptr<statements> statements_;
+
   // A mutex around the database
-  std::shared_mutex sql_mutex_;
+  std::mutex sql_mutex_;
+
+  std::atomic<int> image_count_ = 0;
+  std::atomic<postId> max_post_id_ = 0;
+  std::atomic<iqdbId> max_id_ = 0;
 };
 
 }
@@ -0,0 +1,47 @@
+#ifndef IQDB_STREAMVBYTE_H
+#define IQDB_STREAMVBYTE_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace iqdb {
+
+// Stream VByte coding of sorted integer lists, used to compress the bucket
+// posting lists. Each value is stored as the gap from the previous value, in
+// 1 to 4 little-endian bytes. The lengths are stored separately as 2-bit
+// codes, four to a control byte, all control bytes first and the gap bytes
+// after them. This layout lets four gaps be decoded at once with a single
+// byte shuffle.
+//
+// https://arxiv.org/abs/1709.08990
+
+// The largest number of bytes needed to encode `n` values.
+constexpr size_t streamvbyte_max_bytes(size_t n) {
+  return (n + 3) / 4 + 4 * n;
+}
+
+// Decoding may read up to this many bytes past the end of the encoded data,
+// so buffers must be padded by this much.
+constexpr size_t streamvbyte_padding = 16;
+
+// The number of bytes taken by `n` encoded values, read from their control bytes.
+size_t streamvbyte_encoded_size(const uint8_t* in, size_t n);
+
+// Encode the `n` sorted values in `in` as gaps starting from `prev`. Returns
+// the number of bytes written to `out`.
+size_t streamvbyte_encode(const uint32_t* in, size_t n, uint32_t prev, uint8_t* out);
+
+// Decode `n` values encoded by streamvbyte_encode() with the same `prev`.
+// Uses SSSE3 when the CPU supports it.
+void streamvbyte_decode(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out);
+
+// The decoders streamvbyte_decode() picks between. Only call the SSSE3 one
+// if the CPU supports SSSE3.
+void streamvbyte_decode_scalar(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out);
+#if defined(__x86_64__)
+void streamvbyte_decode_ssse3(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out);
+#endif
+
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef IQDB_THREAD_POOL_H
+#define IQDB_THREAD_POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace iqdb {
+
+// A fixed-size pool of worker threads. Tasks are run in FIFO order.
+class ThreadPool {
+public:
+  struct stats {
+    size_t queued;           // Tasks waiting for a worker.
+    size_t running;          // Tasks being run.
+    size_t completed;        // Tasks finished since the pool was created.
+    size_t rejected;         // Tasks turned away by trySubmit() because the queue was full.
+    double wait_seconds;     // Total time the started tasks waited for a worker.
+    double max_wait_seconds; // Longest time a task waited for a worker.
+    double run_seconds;      // Total time spent running the finished tasks.
+  };
+
+  // If max_queue isn't 0, trySubmit() turns tasks away once that many are
+  // waiting. submit() always queues them.
+  explicit ThreadPool(size_t threads, size_t max_queue = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Number of worker threads in the pool.
+  size_t size() const noexcept { return workers_.size(); }
+  size_t maxQueue() const noexcept { return max_queue_; }
+  stats getStats() const;
+
+  // Queue a function to be run on a worker thread. Returns a future holding
+  // the function's result (or the exception it threw).
+  template <typename F>
+  auto submit(F&& func) -> std::future<decltype(func())> {
+    using result_t = decltype(func());
+    auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<F>(func));
+    auto future = task->get_future();
+
+    {
+      std::lock_guard lock(mutex_);
+      queue_.push_back({ [task] { (*task)(); }, clock::now() });
+    }
+
+    cv_.notify_one();
+    return future;
+  }
+
+  // Queue func(0), ..., func(count - 1), unless they don't all fit in the
+  // queue. The tasks are queued all together or not at all, so a request is
+  // never left half done. Returns their futures, or nothing if the queue was
+  // too full. More than max_queue tasks never fit.
+  template <typename F>
+  auto trySubmit(size_t count, F func) -> std::optional<std::vector<std::future<decltype(func(size_t()))>>> {
+    using result_t = decltype(func(size_t()));
+    std::vector<std::shared_ptr<std::packaged_task<result_t()>>> tasks;
+    std::vector<std::future<result_t>> futures;
+
+    for (size_t i = 0; i < count; i++) {
+      tasks.push_back(std::make_shared<std::packaged_task<result_t()>>([func, i] { return func(i); }));
+      futures.push_back(tasks.back()->get_future());
+    }
+
+    {
+      std::lock_guard lock(mutex_);
+      if (max_queue_ && queue_.size() + count > max_queue_) {
+        rejected_ += count;
+        return std::nullopt;
+      }
+
+      const auto now = clock::now();
+      for (auto& task : tasks)
+        queue_.push_back({ [task] { (*task)(); }, now });
+    }
+
+    cv_.notify_all();
+    return futures;
+  }
+
+  // Like trySubmit() for a single function.
+  template <typename F>
+  auto trySubmit(F func) -> std::optional<std::future<decltype(func())>> {
+    auto futures = trySubmit(1, [func](size_t) { return func(); });
+    if (!futures)
+      return std::nullopt;
+
+    return std::move(futures->front());
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  struct queued_task {
+    std::function<void()> func;
+    clock::time_point queued_at;
+  };
+
+  void run();
+
+  std::vector<std::thread> workers_;
+  const size_t max_queue_;
+  std::deque<queued_task> queue_;
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+
+  // Guarded by mutex_.
+  size_t running_ = 0;
+  size_t completed_ = 0;
+  size_t rejected_ = 0;
+  clock::duration wait_time_ {};
+  clock::duration max_wait_time_ {};
+  clock::duration run_time_ {};
+};
+
+}
+
+#endif
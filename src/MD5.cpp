@@ -1,18 +1,56 @@
-
 #include <iqdb/MD5.h>
 #include <openssl/md5.h>
 
 namespace iqdb
 {
 
-std::string getMD5(const std::string& data)
+std::string getMD5(std::string_view data)
+{
+  md5_digest digest;
+
+  MD5( (const unsigned char*)data.data(), data.size(), digest.data() );
+  return md5ToHex(digest);
+}
+
+static int hex_value(char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+std::optional<md5_digest> md5FromHex(std::string_view hex)
+{
+  md5_digest digest;
+
+  if (hex.size() != 2 * digest.size())
+    return std::nullopt;
+
+  for (size_t i = 0; i < digest.size(); i++) {
+    const int high = hex_value(hex[2 * i]);
+    const int low = hex_value(hex[2 * i + 1]);
+    if (high < 0 || low < 0)
+      return std::nullopt;
+
+    digest[i] = static_cast<uint8_t>(high << 4 | low);
+  }
+
+  return digest;
+}
+
+std::string md5ToHex(const md5_digest& digest)
 {
-  unsigned char digest[MD5_DIGEST_LENGTH];
-  char output[33];
+  static const char digits[] = "0123456789abcdef";
+  std::string output(2 * digest.size(), '0');
 
-  MD5( (unsigned char*)data.c_str(), data.size(), (unsigned char*)&digest );
-  for (int i = 0; i < 16; i++)
-    sprintf( &output[i*2], "%02x", (unsigned int)digest[i] );
+  for (size_t i = 0; i < digest.size(); i++) {
+    output[2 * i] = digits[digest[i] >> 4];
+    output[2 * i + 1] = digits[digest[i] & 0xf];
+  }
 
   return output;
 }
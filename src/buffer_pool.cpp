@@ -0,0 +1,29 @@
+#include <iqdb/buffer_pool.h>
+
+namespace iqdb {
+
+buffer_pool::buffer buffer_pool::acquire() {
+  std::lock_guard lock(mutex_);
+
+  if (free_.empty())
+    return buffer(*this, std::string());
+
+  std::string data = std::move(free_.back());
+  free_.pop_back();
+  free_bytes_ -= data.capacity();
+
+  return buffer(*this, std::move(data));
+}
+
+void buffer_pool::release(std::string data) {
+  data.clear();
+
+  std::lock_guard lock(mutex_);
+  if (free_bytes_ + data.capacity() > max_bytes_)
+    return;
+
+  free_bytes_ += data.capacity();
+  free_.push_back(std::move(data));
+}
+
+}
@@ -0,0 +1,640 @@
+#include <algorithm>
+#include <cmath>
+#include <csetjmp>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gd.h>
+#include <jpeglib.h>
+#include <png.h>
+
+#ifdef HAVE_LIBWEBP
+#include <webp/decode.h>
+#endif
+
+#ifdef HAVE_LIBAVIF
+#include <avif/avif.h>
+#endif
+
+#include <iqdb/debug.h>
+#include <iqdb/decoder.h>
+
+namespace iqdb {
+
+static uint32_t read_be32(const unsigned char *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint32_t read_le32(const unsigned char *p) {
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+static unsigned int read_le16(const unsigned char *p) {
+  return (unsigned int)p[1] << 8 | p[0];
+}
+
+#if defined(HAVE_LIBWEBP) || defined(HAVE_LIBAVIF)
+
+// The size of a w * h image scaled down as far as possible, keeping its
+// aspect ratio, without getting smaller than min_x * min_y. Images that are
+// already smaller are left alone.
+static void scaled_size(unsigned int w, unsigned int h, unsigned int min_x, unsigned int min_y, unsigned int &out_w, unsigned int &out_h) {
+  const double scale = std::max((double)min_x / w, (double)min_y / h);
+
+  if (scale >= 1) {
+    out_w = w;
+    out_h = h;
+  } else {
+    out_w = std::max(min_x, (unsigned int)std::ceil(w * scale));
+    out_h = std::max(min_y, (unsigned int)std::ceil(h * scale));
+  }
+}
+
+// Copy rows of 8-bit RGB pixels into a new truecolor image.
+static RawImage rgb_to_image(const uint8_t *pixels, size_t stride, unsigned int w, unsigned int h) {
+  RawImage img(gdImageCreateTrueColor((int)w, (int)h), &gdImageDestroy);
+  if (!img)
+    return img;
+
+  for (unsigned int y = 0; y < h; y++) {
+    const uint8_t *p = pixels + y * stride;
+    int *out = img->tpixels[y];
+
+    for (unsigned int x = 0; x < w; x++, p += 3) {
+      out[x] = gdTrueColor(p[0], p[1], p[2]);
+    }
+  }
+
+  return img;
+}
+
+#endif
+
+// The parts of a JPEG's frame header (SOFn segment) the decoders need.
+struct jpeg_frame {
+  unsigned int width;
+  unsigned int height;
+  int components;
+  bool progressive;
+};
+
+// Find the frame header by skipping over the segments before it. Stray
+// bytes between segments are skipped, like libjpeg does.
+static bool read_jpeg_frame(const unsigned char *data, size_t len, jpeg_frame &frame) {
+  size_t i = 2;
+
+  while (i + 4 <= len) {
+    const unsigned char marker = data[i + 1];
+
+    if (data[i] != 0xff || marker == 0xff) {
+      i++;
+    } else if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7)) {
+      i += 2; // TEM and RSTn have no length.
+    } else if (marker == 0xd9 || marker == 0xda) {
+      return false; // EOI or SOS before the frame header.
+    } else if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+      // Length, sample precision, height, width, number of components.
+      if (i + 10 > len)
+        return false;
+
+      frame.height = (unsigned int)data[i + 5] << 8 | data[i + 6];
+      frame.width = (unsigned int)data[i + 7] << 8 | data[i + 8];
+      frame.components = data[i + 9];
+      frame.progressive = marker == 0xc2 || marker == 0xc6 || marker == 0xca || marker == 0xce;
+      return frame.width && frame.height;
+    } else {
+      i += 2 + ((size_t)data[i + 2] << 8 | data[i + 3]);
+    }
+  }
+
+  return false;
+}
+
+// The largest of 1/2, 1/4 or 1/8 that libjpeg can scale a w * h image down
+// by without making it smaller than min_x * min_y.
+static unsigned int jpeg_scale_denom(unsigned int w, unsigned int h, unsigned int min_x, unsigned int min_y) {
+  unsigned int denom = 1;
+
+  while (denom < 8 && w / (denom * 2) >= min_x && h / (denom * 2) >= min_y)
+    denom *= 2;
+
+  return denom;
+}
+
+struct jpeg_error_handler {
+  jpeg_error_mgr pub;
+  jmp_buf jump;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  longjmp(reinterpret_cast<jpeg_error_handler *>(cinfo->err)->jump, 1);
+}
+
+// Warnings (e.g. truncated data) are ignored, like libgd does.
+static void jpeg_output_message(j_common_ptr cinfo) {
+}
+
+// Decode a JPEG with libjpeg, letting it scale the image down by 1/2, 1/4 or
+// 1/8 in the DCT as long as it stays at least min_x * min_y. A large photo
+// then only has a fraction of its pixels decoded, instead of all of them
+// being decoded only to be resampled away. Returns null if the image can't be
+// decoded this way.
+//
+// Nothing with a destructor may be alive here when libjpeg longjmp()s back
+// on an error.
+static RawImage decode_scaled_jpeg(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y) {
+  jpeg_decompress_struct cinfo;
+  jpeg_error_handler jerr;
+  gdImagePtr volatile img = nullptr;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpeg_error_exit;
+  jerr.pub.output_message = jpeg_output_message;
+
+  if (setjmp(jerr.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    if (img)
+      gdImageDestroy(img);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, const_cast<unsigned char *>(data), (unsigned long)len);
+  jpeg_read_header(&cinfo, TRUE);
+
+  // Only grayscale, YCbCr and RGB images are handled here.
+  if (cinfo.jpeg_color_space != JCS_GRAYSCALE && cinfo.jpeg_color_space != JCS_YCbCr && cinfo.jpeg_color_space != JCS_RGB) {
+    jpeg_destroy_decompress(&cinfo);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  cinfo.out_color_space = cinfo.jpeg_color_space == JCS_GRAYSCALE ? JCS_GRAYSCALE : JCS_RGB;
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = jpeg_scale_denom(cinfo.image_width, cinfo.image_height, min_x, min_y);
+
+  jpeg_start_decompress(&cinfo);
+
+  img = gdImageCreateTrueColor((int)cinfo.output_width, (int)cinfo.output_height);
+  if (!img) {
+    jpeg_destroy_decompress(&cinfo);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  // Freed by jpeg_destroy_decompress().
+  JSAMPARRAY row = (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, cinfo.output_width * (JDIMENSION)cinfo.output_components, 1);
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    int *out = img->tpixels[cinfo.output_scanline];
+    jpeg_read_scanlines(&cinfo, row, 1);
+
+    const JSAMPLE *p = row[0];
+    for (JDIMENSION x = 0; x < cinfo.output_width; x++) {
+      if (cinfo.output_components == 1) {
+        out[x] = gdTrueColor(p[0], p[0], p[0]);
+        p += 1;
+      } else {
+        out[x] = gdTrueColor(p[0], p[1], p[2]);
+        p += 3;
+      }
+    }
+  }
+
+  if (cinfo.scale_denom > 1)
+    DEBUG("Decoded {} x {} JPEG at 1/{} scale.\n", cinfo.image_width, cinfo.image_height, cinfo.scale_denom);
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  return RawImage(img, &gdImageDestroy);
+}
+
+// CMYK and YCCK images are left to libgd, which knows how to convert them.
+// Images libjpeg fails to decode aren't retried with libgd, since it would
+// only run the same libjpeg over them again.
+static RawImage decode_jpeg(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  jpeg_frame frame;
+
+  if (read_jpeg_frame(data, len, frame) && frame.components != 4)
+    return decode_scaled_jpeg(data, len, min_x, min_y);
+
+  return RawImage(gdImageCreateFromJpegPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+}
+
+// Progressive JPEGs are scaled down too, but libjpeg keeps the whole image's
+// DCT coefficients in memory while it reads all the scans.
+static bool probe_jpeg(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  jpeg_frame frame;
+  if (!read_jpeg_frame(data, len, frame))
+    return false;
+
+  info.width = frame.width;
+  info.height = frame.height;
+
+  if (frame.progressive || frame.components == 4) {
+    info.peak_pixels = (uint64_t)frame.width * frame.height;
+  } else {
+    const unsigned int denom = jpeg_scale_denom(frame.width, frame.height, min_x, min_y);
+    info.peak_pixels = (uint64_t)((frame.width + denom - 1) / denom) * ((frame.height + denom - 1) / denom);
+  }
+
+  return true;
+}
+
+// The parts of a PNG's IHDR chunk the decoders need.
+struct png_header {
+  unsigned int width;
+  unsigned int height;
+  bool interlaced;
+};
+
+// The IHDR chunk always comes first, right after the signature.
+static bool read_png_header(const unsigned char *data, size_t len, png_header &header) {
+  if (len < 29 || memcmp(data + 12, "IHDR", 4) != 0)
+    return false;
+
+  header.width = read_be32(data + 16);
+  header.height = read_be32(data + 20);
+  header.interlaced = data[28] != 0;
+
+  // libpng's default limit.
+  return header.width && header.height && header.width <= PNG_USER_WIDTH_MAX && header.height <= PNG_USER_HEIGHT_MAX;
+}
+
+// The largest whole factor a w * h image can be reduced by without making it
+// smaller than min_x * min_y.
+static unsigned int png_reduce_factor(unsigned int w, unsigned int h, unsigned int min_x, unsigned int min_y) {
+  return std::max(1u, std::min(w / std::max(1u, 2 * min_x), h / std::max(1u, 2 * min_y)));
+}
+
+struct png_source {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+};
+
+static void png_read_source(png_structp png, png_bytep out, size_t n) {
+  auto *source = static_cast<png_source *>(png_get_io_ptr(png));
+  if (n > source->len - source->pos)
+    png_error(png, "Read past end of data");
+
+  memcpy(out, source->data + source->pos, n);
+  source->pos += n;
+}
+
+static void png_error_exit(png_structp png, png_const_charp message) {
+  png_longjmp(png, 1);
+}
+
+// Warnings are ignored, like libgd does.
+static void png_warning_message(png_structp png, png_const_charp message) {
+}
+
+// Decode a PNG with libpng one row at a time, averaging each block of f * f
+// pixels into one as the rows come in, where f is the largest whole factor
+// that keeps the image at least min_x * min_y. Only one row of the full size
+// image is ever in memory, however large the image is. The colors are
+// weighted by their alpha, like gdImageCopyResampled() does. Returns null if
+// the image can't be decoded.
+//
+// Nothing with a destructor may be created here after setjmp(), since
+// libpng longjmp()s back to it on an error.
+static RawImage decode_reduced_png(const unsigned char *data, size_t len, const png_header &header, unsigned int min_x, unsigned int min_y) {
+  const unsigned int w = header.width, h = header.height;
+  const unsigned int f = png_reduce_factor(w, h, min_x, min_y);
+  const unsigned int out_w = (w + f - 1) / f, out_h = (h + f - 1) / f;
+
+  std::vector<png_byte> row((size_t)w * 4);
+  std::vector<uint64_t> sums((size_t)out_w * 4); // The alpha-weighted red, green and blue, and the alpha, of each block in the current row of blocks.
+  png_source source = { data, len, 0 };
+  gdImagePtr volatile img = nullptr;
+
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_error_exit, png_warning_message);
+  png_infop info = png ? png_create_info_struct(png) : nullptr;
+  if (!info) {
+    png_destroy_read_struct(&png, nullptr, nullptr);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, nullptr);
+    if (img)
+      gdImageDestroy(img);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  png_set_read_fn(png, &source, png_read_source);
+  png_read_info(png, info);
+
+  if (png_get_image_width(png, info) != w || png_get_image_height(png, info) != h || png_get_interlace_type(png, info) != PNG_INTERLACE_NONE)
+    png_error(png, "Header changed");
+
+  // Read every pixel as 8-bit RGBA, like libgd does.
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  png_read_update_info(png, info);
+
+  if (png_get_rowbytes(png, info) != row.size())
+    png_error(png, "Unexpected row size");
+
+  img = gdImageCreateTrueColor((int)out_w, (int)out_h);
+  if (!img)
+    png_error(png, "Out of memory");
+
+  for (unsigned int y = 0; y < h; y++) {
+    png_read_row(png, row.data(), nullptr);
+
+    const png_byte *p = row.data();
+    for (unsigned int x = 0; x < w; x++, p += 4) {
+      uint64_t *sum = &sums[(x / f) * 4];
+      sum[0] += (uint64_t)p[0] * p[3];
+      sum[1] += (uint64_t)p[1] * p[3];
+      sum[2] += (uint64_t)p[2] * p[3];
+      sum[3] += p[3];
+    }
+
+    if ((y + 1) % f != 0 && y + 1 != h)
+      continue;
+
+    const unsigned int rows = y % f + 1;
+    int *out = img->tpixels[y / f];
+
+    for (unsigned int x = 0; x < out_w; x++) {
+      uint64_t *sum = &sums[x * 4];
+      const uint64_t pixels = (uint64_t)std::min(f, w - x * f) * rows;
+      const uint64_t alpha = sum[3];
+
+      // Fully transparent blocks are black, as they are after gdImageCopyResampled().
+      const int r = alpha ? (int)((sum[0] + alpha / 2) / alpha) : 0;
+      const int g = alpha ? (int)((sum[1] + alpha / 2) / alpha) : 0;
+      const int b = alpha ? (int)((sum[2] + alpha / 2) / alpha) : 0;
+      const int a = (int)((alpha + pixels / 2) / pixels);
+
+      out[x] = gdTrueColorAlpha(r, g, b, gdAlphaMax - (a >> 1));
+      std::fill(sum, sum + 4, 0);
+    }
+  }
+
+  if (f > 1)
+    DEBUG("Decoded {} x {} PNG at 1/{} scale.\n", w, h, f);
+
+  png_destroy_read_struct(&png, &info, nullptr);
+  return RawImage(img, &gdImageDestroy);
+}
+
+// PNGs are decoded by libgd, at full size, unless that would take more than
+// max_decode_pixels. Only then are they reduced while they're read, which
+// changes their signature a little. Interlaced PNGs can't be read one row at
+// a time, and are always left to libgd.
+static RawImage decode_png(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  png_header header;
+
+  if (read_png_header(data, len, header) && !header.interlaced && (uint64_t)header.width * header.height > limits.max_decode_pixels)
+    return decode_reduced_png(data, len, header, min_x, min_y);
+
+  return RawImage(gdImageCreateFromPngPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+}
+
+// A non-interlaced PNG too big to decode at full size is reduced while it's
+// read, so its peak is the reduced size.
+static bool probe_png(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  png_header header;
+  if (!read_png_header(data, len, header))
+    return false;
+
+  info.width = header.width;
+  info.height = header.height;
+
+  if (header.interlaced) {
+    info.peak_pixels = (uint64_t)header.width * header.height;
+  } else {
+    const unsigned int f = png_reduce_factor(header.width, header.height, min_x, min_y);
+    info.peak_pixels = (uint64_t)((header.width + f - 1) / f) * ((header.height + f - 1) / f) + header.width;
+  }
+
+  return true;
+}
+
+static RawImage decode_gif(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  return RawImage(gdImageCreateFromGifPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+}
+
+static RawImage decode_bmp(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  return RawImage(gdImageCreateFromBmpPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+}
+
+// The logical screen size, which every frame has to fit in.
+static bool probe_gif(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  if (len < 10)
+    return false;
+
+  info.width = read_le16(data + 6);
+  info.height = read_le16(data + 8);
+  info.peak_pixels = (uint64_t)info.width * info.height;
+  return info.width && info.height;
+}
+
+// The file header, then a BITMAPCOREHEADER with 16-bit dimensions or a
+// BITMAPINFOHEADER (or a later version) with 32-bit ones. The height is
+// negative for top-down images.
+static bool probe_bmp(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  if (len < 26)
+    return false;
+
+  if (read_le32(data + 14) == 12) {
+    info.width = read_le16(data + 18);
+    info.height = read_le16(data + 20);
+  } else {
+    const int64_t width = (int32_t)read_le32(data + 18);
+    const int64_t height = (int32_t)read_le32(data + 22);
+    if (width <= 0 || height == 0)
+      return false;
+
+    info.width = (unsigned int)width;
+    info.height = (unsigned int)std::abs(height);
+  }
+
+  info.peak_pixels = (uint64_t)info.width * info.height;
+  return info.width && info.height;
+}
+
+#ifdef HAVE_LIBWEBP
+
+// libwebp scales the image down while decoding it, so the full size image is
+// never stored. Animated images aren't supported.
+static RawImage decode_webp(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  WebPDecoderConfig config;
+  unsigned int w, h;
+
+  if (!WebPInitDecoderConfig(&config) || WebPGetFeatures(data, len, &config.input) != VP8_STATUS_OK)
+    return RawImage(nullptr, &gdImageDestroy);
+
+  scaled_size((unsigned int)config.input.width, (unsigned int)config.input.height, min_x, min_y, w, h);
+  if (w != (unsigned int)config.input.width || h != (unsigned int)config.input.height) {
+    config.options.use_scaling = 1;
+    config.options.scaled_width = (int)w;
+    config.options.scaled_height = (int)h;
+  }
+
+  config.output.colorspace = MODE_RGB;
+  if (WebPDecode(data, len, &config) != VP8_STATUS_OK) {
+    WebPFreeDecBuffer(&config.output);
+    return RawImage(nullptr, &gdImageDestroy);
+  }
+
+  const auto &rgb = config.output.u.RGBA;
+  RawImage img = rgb_to_image(rgb.rgba, (size_t)rgb.stride, (unsigned int)config.output.width, (unsigned int)config.output.height);
+  WebPFreeDecBuffer(&config.output);
+
+  return img;
+}
+
+// Only lossy images are decoded a few rows at a time. Lossless images, and
+// the alpha of lossy ones, are decoded at full size before they're scaled.
+static bool probe_webp(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  WebPBitstreamFeatures features;
+  if (WebPGetFeatures(data, len, &features) != VP8_STATUS_OK)
+    return false;
+
+  info.width = (unsigned int)features.width;
+  info.height = (unsigned int)features.height;
+
+  if (features.format == 1 && !features.has_alpha) {
+    unsigned int w, h;
+    scaled_size(info.width, info.height, min_x, min_y, w, h);
+    info.peak_pixels = (uint64_t)w * h;
+  } else {
+    info.peak_pixels = (uint64_t)info.width * info.height;
+  }
+
+  return true;
+}
+
+#endif
+
+#ifdef HAVE_LIBAVIF
+
+// Only the first frame of an image sequence is decoded. With libavif 1.0 or
+// later the YUV planes are scaled down before they're converted to RGB;
+// older versions convert the full size image.
+static RawImage decode_avif(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, const decode_limits &limits) {
+  std::unique_ptr<avifDecoder, decltype(&avifDecoderDestroy)> decoder(avifDecoderCreate(), &avifDecoderDestroy);
+  avifRGBImage rgb;
+  unsigned int w, h;
+
+  if (!decoder || avifDecoderSetIOMemory(decoder.get(), data, len) != AVIF_RESULT_OK || avifDecoderParse(decoder.get()) != AVIF_RESULT_OK || avifDecoderNextImage(decoder.get()) != AVIF_RESULT_OK)
+    return RawImage(nullptr, &gdImageDestroy);
+
+  avifImage *image = decoder->image;
+
+#if AVIF_VERSION_MAJOR >= 1
+  scaled_size(image->width, image->height, min_x, min_y, w, h);
+  if (w != image->width || h != image->height) {
+    avifDiagnostics diag;
+
+    // If scaling fails the image is left as it was, and converted at full size.
+    if (avifImageScale(image, w, h, &diag) != AVIF_RESULT_OK)
+      DEBUG("Couldn't scale {} x {} AVIF to {} x {}: {}\n", image->width, image->height, w, h, diag.error);
+  }
+#endif
+
+  avifRGBImageSetDefaults(&rgb, image);
+  rgb.format = AVIF_RGB_FORMAT_RGB;
+  rgb.depth = 8;
+
+  avifRGBImageAllocatePixels(&rgb);
+  if (!rgb.pixels)
+    return RawImage(nullptr, &gdImageDestroy);
+
+  RawImage img(nullptr, &gdImageDestroy);
+  if (avifImageYUVToRGB(image, &rgb) == AVIF_RESULT_OK)
+    img = rgb_to_image(rgb.pixels, rgb.rowBytes, rgb.width, rgb.height);
+
+  avifRGBImageFreePixels(&rgb);
+  return img;
+}
+
+// Parsing the container reads the image's size without decoding it. The
+// AV1 codec always decodes the full size image.
+static bool probe_avif(const unsigned char *data, size_t len, unsigned int min_x, unsigned int min_y, image_info &info) {
+  std::unique_ptr<avifDecoder, decltype(&avifDecoderDestroy)> decoder(avifDecoderCreate(), &avifDecoderDestroy);
+
+  if (!decoder || avifDecoderSetIOMemory(decoder.get(), data, len) != AVIF_RESULT_OK || avifDecoderParse(decoder.get()) != AVIF_RESULT_OK)
+    return false;
+
+  info.width = decoder->image->width;
+  info.height = decoder->image->height;
+  info.peak_pixels = (uint64_t)info.width * info.height;
+  return info.width && info.height;
+}
+
+#endif
+
+static bool is_jpeg(const unsigned char *data, size_t len) {
+  return len >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0;
+}
+
+static bool is_png(const unsigned char *data, size_t len) {
+  return len >= 4 && memcmp(data, "\x89\x50\x4e\x47", 4) == 0;
+}
+
+static bool is_gif(const unsigned char *data, size_t len) {
+  return len >= 3 && memcmp(data, "\x47\x49\x46", 3) == 0;
+}
+
+static bool is_bmp(const unsigned char *data, size_t len) {
+  return len >= 2 && memcmp(data, "\x42\x4d", 2) == 0;
+}
+
+// "RIFF", the file size, then "WEBP".
+static bool is_webp(const unsigned char *data, size_t len) {
+  return len >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WEBP", 4) == 0;
+}
+
+// An ISO BMFF `ftyp` box whose major or compatible brands include `avif`
+// (still image) or `avis` (image sequence).
+static bool is_avif(const unsigned char *data, size_t len) {
+  if (len < 16 || memcmp(data + 4, "ftyp", 4) != 0)
+    return false;
+
+  const size_t box_size = std::min<size_t>(len, read_be32(data));
+
+  // The major brand at offset 8, then the minor version, then the compatible brands.
+  for (size_t i = 8; i + 4 <= box_size; i += (i == 8 ? 8 : 4)) {
+    if (memcmp(data + i, "avif", 4) == 0 || memcmp(data + i, "avis", 4) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+static const image_decoder decoders[] = {
+  { "JPEG", is_jpeg, probe_jpeg, decode_jpeg },
+  { "PNG", is_png, probe_png, decode_png },
+  { "GIF", is_gif, probe_gif, decode_gif },
+  { "BMP", is_bmp, probe_bmp, decode_bmp },
+#ifdef HAVE_LIBWEBP
+  { "WebP", is_webp, probe_webp, decode_webp },
+#else
+  { "WebP", is_webp, nullptr, nullptr },
+#endif
+#ifdef HAVE_LIBAVIF
+  { "AVIF", is_avif, probe_avif, decode_avif },
+#else
+  { "AVIF", is_avif, nullptr, nullptr },
+#endif
+};
+
+const image_decoder *find_decoder(const unsigned char *data, size_t len) {
+  for (const auto &decoder : decoders) {
+    if (decoder.matches(data, len))
+      return &decoder;
+  }
+
+  return nullptr;
+}
+
+}
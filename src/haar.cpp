@@ -27,8 +27,13 @@
     - separate processing per array: better cache behavior
     - do away with all scaling; not needed except for DC component
 
-    To do:
-    - the whole Haar transform should be done using fixpoints
+    Later speed-ups:
+    - decompose all columns at once, a row at a time, with SIMD kernels;
+      rows are decomposed as the columns of the transposed array
+    - still done in doubles: fixpoints or floats would round differently and
+      change which coefficients make it into existing signatures
+    - skip ahead to the coefficients that make it into the bounded queue
+      with a SIMD scan, instead of trying every one
 
     This program is free software; you can redistribute it and/or modify
     it under the terms of the GNU General Public License as published by
@@ -51,6 +56,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <utility>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 /* imgSeek Includes */
 #include <iqdb/haar.h>
 
@@ -74,72 +86,139 @@ namespace iqdb {
     }                                                 \
   } while (0)
 
-// Do the Haar tensorial 2d transform itself.
-// Here input is RGB data [0..255] in Unit arrays
-// Computation is (almost) in-situ.
-static void
-haar2D(Unit a[]) {
-  int i;
-  Unit t[NUM_PIXELS >> 1];
+using haar_step_kernel = void (*)(const Unit *even, const Unit *odd, Unit *sum, Unit *diff, Unit C, int begin, int end);
+
+// One step of the Haar transform on n pairs of elements:
+//
+//   diff[x] = (even[x] - odd[x]) * C
+//   sum[x]  = even[x] + odd[x]
+//
+// sum may be the same array as even.
+static void haar_step_scalar(const Unit *even, const Unit *odd, Unit *sum, Unit *diff, Unit C, int begin, int end) {
+  for (int x = begin; x < end; x++) {
+    const Unit e = even[x];
+    const Unit o = odd[x];
+
+    diff[x] = (e - o) * C;
+    sum[x] = e + o;
+  }
+}
 
-  // Decompose rows:
-  for (i = 0; i < NUM_PIXELS_SQUARED; i += NUM_PIXELS) {
-    int h, h1;
-    Unit C = 1;
+#if defined(__x86_64__)
 
-    for (h = NUM_PIXELS; h > 1; h = h1) {
-      int j1, j2, k;
+// Same operations as the scalar kernel (no FMA), so the results are
+// bit-identical.
+__attribute__((target("avx2")))
+static void haar_step_avx2(const Unit *even, const Unit *odd, Unit *sum, Unit *diff, Unit C, int begin, int end) {
+  const __m256d c = _mm256_set1_pd(C);
 
-      h1 = h >> 1; // h = 2*h1
-      C *= 0.7071; // 1/sqrt(2)
-      for (k = 0, j1 = j2 = i; k < h1; k++, j1++, j2 += 2) {
-        int j21 = j2 + 1;
+  // Stop where fewer than 4 columns are left, computed once so the loop
+  // condition doesn't need `x + 4`.
+  const int last = end - (end - begin) % 4;
 
-        t[k] = (a[j2] - a[j21]) * C;
-        a[j1] = (a[j2] + a[j21]);
-      }
-      // Write back subtraction results:
-      memcpy(a + i + h1, t, h1 * sizeof(a[0]));
-    }
-    // Fix first element of each row:
-    a[i] *= C; // C = 1/sqrt(NUM_PIXELS)
+  int x = begin;
+  for (; x < last; x += 4) {
+    const __m256d e = _mm256_loadu_pd(even + x);
+    const __m256d o = _mm256_loadu_pd(odd + x);
+
+    _mm256_storeu_pd(diff + x, _mm256_mul_pd(_mm256_sub_pd(e, o), c));
+    _mm256_storeu_pd(sum + x, _mm256_add_pd(e, o));
   }
 
-  // Decompose columns:
-  for (i = 0; i < NUM_PIXELS; i++) {
-    Unit C = 1;
-    int h, h1;
+  haar_step_scalar(even, odd, sum, diff, C, x, end);
+}
+
+static void haar_step_sse2(const Unit *even, const Unit *odd, Unit *sum, Unit *diff, Unit C, int begin, int end) {
+  const __m128d c = _mm_set1_pd(C);
 
-    for (h = NUM_PIXELS; h > 1; h = h1) {
-      int j1, j2, k;
+  const int last = end - (end - begin) % 2;
+
+  int x = begin;
+  for (; x < last; x += 2) {
+    const __m128d e = _mm_loadu_pd(even + x);
+    const __m128d o = _mm_loadu_pd(odd + x);
+
+    _mm_storeu_pd(diff + x, _mm_mul_pd(_mm_sub_pd(e, o), c));
+    _mm_storeu_pd(sum + x, _mm_add_pd(e, o));
+  }
 
-      h1 = h >> 1;
-      C *= 0.7071; // 1/sqrt(2) = 0.7071
-      for (k = 0, j1 = j2 = i; k < h1;
-           k++, j1 += NUM_PIXELS, j2 += 2 * NUM_PIXELS) {
-        int j21 = j2 + NUM_PIXELS;
+  haar_step_scalar(even, odd, sum, diff, C, x, end);
+}
+
+#endif
+
+// Pick the best kernel for this CPU. SSE2 is always available on x86-64.
+static haar_step_kernel select_haar_step_kernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    return haar_step_avx2;
+
+  return haar_step_sse2;
+#else
+  return haar_step_scalar;
+#endif
+}
 
-        t[k] = (a[j2] - a[j21]) * C;
-        a[j1] = (a[j2] + a[j21]);
+// Transpose a NUM_PIXELS x NUM_PIXELS array in place, in square blocks that
+// fit in cache.
+static void
+transpose(Unit a[]) {
+  const size_t N = NUM_PIXELS;
+  const size_t B = 16;
+
+  for (size_t bi = 0; bi < N; bi += B) {
+    for (size_t bj = bi; bj < N; bj += B) {
+      for (size_t i = bi; i < bi + B; i++) {
+        for (size_t j = (bi == bj ? i + 1 : bj); j < bj + B; j++) {
+          std::swap(a[i * N + j], a[j * N + i]);
+        }
       }
-      // Write back subtraction results:
-      for (k = 0, j1 = i + h1 * NUM_PIXELS; k < h1; k++, j1 += NUM_PIXELS)
-        a[j1] = t[k];
     }
-    // Fix first element of each column:
-    a[i] *= C;
   }
 }
 
-/* Do the Haar tensorial 2d transform itself.
-   Here input is RGB data [0..255] in Unit arrays.
-   Results are available in a, b, and c.
-   Fully inplace calculation; order of result is interleaved though,
-   but we don't care about that.
-*/
-void transform(Unit *a, Unit *b, Unit *c) {
-  RGB_2_YIQ(a, b, c);
+// Decompose all columns at once. Each step combines two whole rows, so the
+// pass reads memory in order and the kernels can work on several columns at
+// a time. Every element goes through the same operations as when the
+// columns were decomposed one by one.
+static void
+haarColumns(Unit a[]) {
+  static const haar_step_kernel step = select_haar_step_kernel();
+  static thread_local Unit t[(NUM_PIXELS >> 1) * NUM_PIXELS];
+  Unit C = 1;
+  int h, h1;
+
+  for (h = NUM_PIXELS; h > 1; h = h1) {
+    int k;
+
+    h1 = h >> 1;
+    C *= 0.7071; // 1/sqrt(2) = 0.7071
+    for (k = 0; k < h1; k++) {
+      step(a + 2 * k * NUM_PIXELS, a + (2 * k + 1) * NUM_PIXELS, a + k * NUM_PIXELS, t + k * NUM_PIXELS, C, 0, NUM_PIXELS);
+    }
+    // Write back subtraction results:
+    memcpy(a + h1 * NUM_PIXELS, t, h1 * NUM_PIXELS * sizeof(a[0]));
+  }
+  // Fix first element of each column:
+  for (int i = 0; i < NUM_PIXELS; i++)
+    a[i] *= C; // C = 1/sqrt(NUM_PIXELS)
+}
 
+// Do the Haar tensorial 2d transform itself.
+// Here input is RGB data [0..255] in Unit arrays
+// Computation is (almost) in-situ. The rows are decomposed as the columns of
+// the transposed array, so both passes can use haarColumns().
+static void
+haar2D(Unit a[]) {
+  transpose(a);
+  haarColumns(a);
+  transpose(a);
+  haarColumns(a);
+}
+
+// The Haar transform of YIQ data in Unit arrays, in place.
+static void
+transformYIQ(Unit *a, Unit *b, Unit *c) {
   haar2D(a);
   haar2D(b);
   haar2D(c);
@@ -150,6 +229,17 @@ void transform(Unit *a, Unit *b, Unit *c) {
   c[0] /= 256 * 128;
 }
 
+/* Do the Haar tensorial 2d transform itself.
+   Here input is RGB data [0..255] in Unit arrays.
+   Results are available in a, b, and c.
+   Fully inplace calculation; order of result is interleaved though,
+   but we don't care about that.
+*/
+void transform(Unit *a, Unit *b, Unit *c) {
+  RGB_2_YIQ(a, b, c);
+  transformYIQ(a, b, c);
+}
+
 // Do the Haar tensorial 2d transform itself.
 // Here input RGB data is in unsigned char arrays ([0..255])
 // Results are available in a, b, and c.
@@ -168,12 +258,114 @@ void transformChar(unsigned char *c1, unsigned char *c2, unsigned char *c3,
   transform(a, b, c);
 }
 
+// Do the Haar tensorial 2d transform itself.
+// Here input is NUM_PIXELS rows of NUM_PIXELS packed 0xAARRGGBB pixels, the
+// layout of a libgd truecolor image; alpha is ignored. Each pixel is
+// converted straight to YIQ, with the same operations as RGB_2_YIQ, so the
+// results are the same as from transformChar() on the separate channels.
+// Results are available in a, b, and c.
+void transformPixels(const int *const *rows, Unit *a, Unit *b, Unit *c) {
+  for (int y = 0; y < NUM_PIXELS; y++) {
+    const int *row = rows[y];
+    const int i = y * NUM_PIXELS;
+
+    for (int x = 0; x < NUM_PIXELS; x++) {
+      const Unit R = (row[x] >> 16) & 0xFF;
+      const Unit G = (row[x] >> 8) & 0xFF;
+      const Unit B = row[x] & 0xFF;
+
+      a[i + x] = 0.299 * R + 0.587 * G + 0.114 * B;
+      b[i + x] = 0.596 * R - 0.275 * G - 0.321 * B;
+      c[i + x] = 0.212 * R - 0.523 * G + 0.311 * B;
+    }
+  }
+
+  transformYIQ(a, b, c);
+}
+
+using scan_kernel = int (*)(const Unit *cdata, Unit threshold, int begin, int end);
+
+// Return the index of the first element in [begin, end) of cdata[] whose
+// magnitude is greater than `threshold`, or `end` if there is none.
+static int
+find_larger_scalar(const Unit *cdata, Unit threshold, int begin, int end) {
+  for (int i = begin; i < end; i++) {
+    if (fabs(cdata[i]) > threshold)
+      return i;
+  }
+
+  return end;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2")))
+static int
+find_larger_avx2(const Unit *cdata, Unit threshold, int begin, int end) {
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d t = _mm256_set1_pd(threshold);
+
+  const int last = end - (end - begin) % 8;
+
+  int i = begin;
+  for (; i < last; i += 8) {
+    const __m256d v0 = _mm256_andnot_pd(sign, _mm256_loadu_pd(cdata + i));
+    const __m256d v1 = _mm256_andnot_pd(sign, _mm256_loadu_pd(cdata + i + 4));
+    const int mask = _mm256_movemask_pd(_mm256_cmp_pd(v0, t, _CMP_GT_OQ)) | _mm256_movemask_pd(_mm256_cmp_pd(v1, t, _CMP_GT_OQ)) << 4;
+
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return find_larger_scalar(cdata, threshold, i, end);
+}
+
+static int
+find_larger_sse2(const Unit *cdata, Unit threshold, int begin, int end) {
+  const __m128d sign = _mm_set1_pd(-0.0);
+  const __m128d t = _mm_set1_pd(threshold);
+
+  const int last = end - (end - begin) % 4;
+
+  int i = begin;
+  for (; i < last; i += 4) {
+    const __m128d v0 = _mm_andnot_pd(sign, _mm_loadu_pd(cdata + i));
+    const __m128d v1 = _mm_andnot_pd(sign, _mm_loadu_pd(cdata + i + 2));
+    const int mask = _mm_movemask_pd(_mm_cmpgt_pd(v0, t)) | _mm_movemask_pd(_mm_cmpgt_pd(v1, t)) << 2;
+
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+
+  return find_larger_scalar(cdata, threshold, i, end);
+}
+
+#endif
+
+// Pick the best kernel for this CPU. SSE2 is always available on x86-64.
+static scan_kernel select_scan_kernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    return find_larger_avx2;
+
+  return find_larger_sse2;
+#else
+  return find_larger_scalar;
+#endif
+}
+
 // Find the NUM_COEFS largest numbers in cdata[] (in magnitude that is)
-// and store their indices in sig[].
+// and store their indices in sig[], in ascending order.
+//
+// Once the queue is full, only coefficients larger than the smallest one in
+// the queue change it, and those are few. The scan kernel skips ahead to the
+// next one, so the queue sees exactly the same pushes and pops as if every
+// coefficient were tried in turn, and ties are broken the same way.
 inline static void
 get_m_largests(Unit *cdata, Idx *sig) {
+  static const scan_kernel find_larger = select_scan_kernel();
   int cnt = 0;
-  Idx i = 0;
+  int i = 0;
   valStruct val;
   std::priority_queue<valStruct> vq; // dynamic priority queue of valStruct's
 
@@ -181,23 +373,20 @@ get_m_largests(Unit *cdata, Idx *sig) {
 
   // Fill up the bounded queue. (Assuming NUM_PIXELS_SQUARED > NUM_COEFS)
   for (i = 1; i < NUM_COEFS + 1; i++) {
-    val.i = i;
+    val.i = (Idx)i;
     val.d = fabs(cdata[i]);
     vq.push(val);
   }
   // Queue is full (size is NUM_COEFS)
 
-  for (/*i = NUM_COEFS+1*/; i < NUM_PIXELS_SQUARED; i++) {
+  while ((i = find_larger(cdata, vq.top().d, i, NUM_PIXELS_SQUARED)) < NUM_PIXELS_SQUARED) {
+    // Make room by dropping smallest entry:
+    vq.pop();
+    // Insert val as new entry:
+    val.i = (Idx)i;
     val.d = fabs(cdata[i]);
-
-    if (val.d > vq.top().d) {
-      // Make room by dropping smallest entry:
-      vq.pop();
-      // Insert val as new entry:
-      val.i = i;
-      vq.push(val);
-    }
-    // else discard: do nothing
+    vq.push(val);
+    i++;
   }
 
   // Empty the (non-empty) queue and fill-in sig:
@@ -211,13 +400,14 @@ get_m_largests(Unit *cdata, Idx *sig) {
     vq.pop();
   }
   // Must have cnt==NUM_COEFS here.
+
+  std::sort(sig, sig + NUM_COEFS);
 }
 
 // Determines a total of NUM_COEFS positions in the image that have the
 // largest magnitude (absolute value) in color value. Returns linearized
-// coordinates in sig1, sig2, and sig3. avgl are the [0,0] values.
-// The order of occurrence of the coordinates in sig doesn't matter.
-// Complexity is 3 x NUM_PIXELS^2 x 2log(NUM_COEFS).
+// coordinates in sig1, sig2, and sig3, sorted in ascending order. avgl are
+// the [0,0] values.
 int calcHaar(Unit *cdata1, Unit *cdata2, Unit *cdata3,
              Idx *sig1, Idx *sig2, Idx *sig3, double *avgl) {
   avgl[0] = cdata1[0];
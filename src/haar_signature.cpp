@@ -41,34 +41,19 @@ HaarSignature HaarSignature::from_hash(const std::string hash) {
   return haar;
 }
 
-HaarSignature HaarSignature::from_file_content(const std::string blob) {
+HaarSignature HaarSignature::from_file_content(std::string_view blob, const decode_limits& limits) {
   HaarSignature signature;
-  std::vector<unsigned char> rchan(NUM_PIXELS * NUM_PIXELS);
-  std::vector<unsigned char> gchan(NUM_PIXELS * NUM_PIXELS);
-  std::vector<unsigned char> bchan(NUM_PIXELS * NUM_PIXELS);
-
-  auto image = resize_image_data((const unsigned char *)blob.data(), blob.size(), NUM_PIXELS, NUM_PIXELS);
-
-  for (int y = 0; y < NUM_PIXELS; y++) {
-    for (int x = 0; x < NUM_PIXELS; x++) {
-      // https://libgd.github.io/manuals/2.3.1/files/gd-c.html#gdImageGetPixel
-      // https://libgd.github.io/manuals/2.3.1/files/gd-h.html#gdTrueColorGetRed
-      int pixel = gdImageGetPixel(image.get(), x, y);
-      rchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetRed(pixel));
-      gchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetGreen(pixel));
-      bchan[x + y * NUM_PIXELS] = static_cast<unsigned char>(gdTrueColorGetBlue(pixel));
-    }
-  }
 
-  std::vector<Unit> cdata1(NUM_PIXELS * NUM_PIXELS);
-  std::vector<Unit> cdata2(NUM_PIXELS * NUM_PIXELS);
-  std::vector<Unit> cdata3(NUM_PIXELS * NUM_PIXELS);
-  transformChar(rchan.data(), gchan.data(), bchan.data(), cdata1.data(), cdata2.data(), cdata3.data());
-  calcHaar(cdata1.data(), cdata2.data(), cdata3.data(), signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
+  // Reused from one call to the next on each thread, instead of allocated.
+  static thread_local Unit cdata[3][NUM_PIXELS * NUM_PIXELS];
+
+  auto image = resize_image_data((const unsigned char *)blob.data(), blob.size(), NUM_PIXELS, NUM_PIXELS, limits);
 
-  std::sort(&signature.sig[0][0], &signature.sig[0][NUM_COEFS]);
-  std::sort(&signature.sig[1][0], &signature.sig[1][NUM_COEFS]);
-  std::sort(&signature.sig[2][0], &signature.sig[2][NUM_COEFS]);
+  // resize_image_data() always returns a NUM_PIXELS x NUM_PIXELS truecolor
+  // image, so its pixels can be read straight from its rows.
+  // https://libgd.github.io/manuals/2.3.1/files/gd-h.html#gdImageStruct
+  transformPixels(image->tpixels, cdata[0], cdata[1], cdata[2]);
+  calcHaar(cdata[0], cdata[1], cdata[2], signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
 
   return signature;
 }
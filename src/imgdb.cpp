@@ -24,56 +24,428 @@
 #include <sys/mman.h>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
 #include <vector>
 
 #include <iqdb/debug.h>
 #include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
 #include <iqdb/haar_signature.h>
+#include <iqdb/log_db.h>
+#include <iqdb/MD5.h>
+#include <iqdb/score_kernels.h>
 #include <iqdb/sqlite_db.h>
 
 namespace iqdb {
 
-void bucket_set::add(const HaarSignature &sig, imageId iqdb_id) {
-  eachBucket(sig, [&](auto& bucket) {
-    bucket.push_back(iqdb_id);
-  });
+void image_table::resize(size_t n) {
+  while (size() < n) {
+    chunks_.push_back(std::make_shared<chunk>());
+  }
+}
+
+void image_table::clear() {
+  chunks_.clear();
+}
+
+image_table::chunk& image_table::mutableChunk(imageId iqdb_id) {
+  // Only this table can hand out new references to its chunks, so a use
+  // count of one means no other table can see the chunk.
+  auto& c = chunks_.at(iqdb_id / chunk_size);
+  if (c.use_count() > 1)
+    c = std::make_shared<chunk>(*c);
+
+  return *c;
+}
+
+void image_table::set(imageId iqdb_id, postId post, const HaarSignature& haar) {
+  auto& c = mutableChunk(iqdb_id);
+  const size_t i = iqdb_id % chunk_size;
+
+  c.post_id[i] = post;
+  c.avgl[0][i] = static_cast<Score>(haar.avglf[0]);
+  c.avgl[1][i] = static_cast<Score>(haar.avglf[1]);
+  c.avgl[2][i] = static_cast<Score>(haar.avglf[2]);
+}
+
+void image_table::erase(imageId iqdb_id) {
+  mutableChunk(iqdb_id).avgl[0][iqdb_id % chunk_size] = 0;
+}
+
+void image_table::save(snapshot_writer& writer) const {
+  const uint64_t n_chunks = chunks_.size();
+  writer.write(&n_chunks, 1);
+
+  for (const auto& c : chunks_) {
+    writer.write(c.get(), 1);
+  }
+}
+
+void image_table::load(snapshot_reader& reader) {
+  uint64_t n_chunks;
+  reader.read(&n_chunks, 1);
+
+  clear();
+  for (uint64_t i = 0; i < n_chunks; i++) {
+    auto c = std::make_shared<chunk>();
+    reader.read(c.get(), 1);
+    chunks_.push_back(std::move(c));
+  }
+}
+
+// The chunk of `chunks` holding row `i`, copied first if it's shared with
+// another table.
+template <typename T>
+static T& mutable_chunk(std::vector<std::shared_ptr<T>>& chunks, size_t i, size_t chunk_size) {
+  auto& c = chunks.at(i / chunk_size);
+  if (c.use_count() > 1)
+    c = std::make_shared<T>(*c);
+
+  return *c;
 }
 
-void bucket_set::remove(const HaarSignature &sig, imageId iqdb_id) {
-  eachBucket(sig, [&](auto& bucket) {
-    // https://en.wikipedia.org/wiki/Erase-remove_idiom
-    bucket.erase(std::remove(bucket.begin(), bucket.end(), iqdb_id), bucket.end());
+void image_metadata::resize(size_t n) {
+  while (size() < n) {
+    md5s_.push_back(std::make_shared<md5_chunk>());
+
+    if (keep_signatures_)
+      signatures_.push_back(std::make_shared<signature_chunk>());
+  }
+}
+
+void image_metadata::clear() {
+  md5s_.clear();
+  signatures_.clear();
+}
+
+const HaarSignature* image_metadata::signatureOf(iqdbId iqdb_id) const {
+  if (!keep_signatures_)
+    return nullptr;
+
+  return &signatures_.at(iqdb_id / chunk_size)->haar[iqdb_id % chunk_size];
+}
+
+void image_metadata::set(iqdbId iqdb_id, const md5_digest& md5, const HaarSignature& haar) {
+  mutable_chunk(md5s_, iqdb_id, chunk_size).md5[iqdb_id % chunk_size] = md5;
+
+  if (keep_signatures_)
+    mutable_chunk(signatures_, iqdb_id, chunk_size).haar[iqdb_id % chunk_size] = haar;
+}
+
+void image_metadata::save(snapshot_writer& writer) const {
+  const uint64_t n_chunks[2] = { md5s_.size(), signatures_.size() };
+  writer.write(n_chunks, 2);
+
+  for (const auto& c : md5s_) {
+    writer.write(c.get(), 1);
+  }
+
+  for (const auto& c : signatures_) {
+    writer.write(c.get(), 1);
+  }
+}
+
+// A snapshot saved without signatures can't be loaded with them; one saved
+// with them can, and they're skipped.
+void image_metadata::load(snapshot_reader& reader) {
+  uint64_t n_chunks[2];
+  reader.read(n_chunks, 2);
+
+  if (keep_signatures_ && n_chunks[1] != n_chunks[0])
+    throw snapshot_error("Snapshot has no signatures");
+
+  clear();
+  for (uint64_t i = 0; i < n_chunks[0]; i++) {
+    auto c = std::make_shared<md5_chunk>();
+    reader.read(c.get(), 1);
+    md5s_.push_back(std::move(c));
+  }
+
+  for (uint64_t i = 0; i < n_chunks[1]; i++) {
+    auto c = std::make_shared<signature_chunk>();
+    reader.read(c.get(), 1);
+
+    if (keep_signatures_)
+      signatures_.push_back(std::move(c));
+  }
+}
+
+// Post ids are handed out in order, so they spread evenly over the shards
+// as they are. md5s are already random.
+static size_t shard_of(postId key) {
+  return key % id_map<postId>::shard_count;
+}
+
+static size_t shard_of(const md5_digest& key) {
+  return (static_cast<size_t>(key[0]) << 8 | key[1]) % id_map<md5_digest>::shard_count;
+}
+
+template <typename Key>
+static auto find_entry(std::vector<typename id_map<Key>::entry>& shard, const Key& key) {
+  return std::lower_bound(shard.begin(), shard.end(), key, [](const auto& entry, const Key& k) {
+    return entry.key < k;
   });
 }
 
-bucket_t& bucket_set::at(int color, int coef) {
-  const int sign = coef < 0;
-  return buckets[color][sign][abs(coef)];
+template <typename Key>
+std::optional<iqdbId> id_map<Key>::find(const Key& key) const {
+  const auto& s = shards_[shard_of(key)];
+  if (!s)
+    return std::nullopt;
+
+  const auto it = find_entry(*s, key);
+  if (it == s->end() || it->key != key)
+    return std::nullopt;
+
+  return it->id;
+}
+
+template <typename Key>
+void id_map<Key>::insert(const Key& key, iqdbId iqdb_id) {
+  auto& s = shards_[shard_of(key)];
+  if (!s)
+    s = std::make_shared<shard>();
+  else if (s.use_count() > 1)
+    s = std::make_shared<shard>(*s);
+
+  const auto it = find_entry(*s, key);
+  if (it != s->end() && it->key == key)
+    it->id = iqdb_id;
+  else
+    s->insert(it, { key, iqdb_id });
+}
+
+template <typename Key>
+void id_map<Key>::erase(const Key& key, iqdbId iqdb_id) {
+  auto& s = shards_[shard_of(key)];
+  if (!s)
+    return;
+
+  auto it = find_entry(*s, key);
+  if (it == s->end() || it->key != key || it->id != iqdb_id)
+    return;
+
+  if (s->size() == 1) {
+    s.reset();
+    return;
+  }
+
+  if (s.use_count() > 1) {
+    const auto offset = it - s->begin();
+    s = std::make_shared<shard>(*s);
+    it = s->begin() + offset;
+  }
+
+  s->erase(it);
+}
+
+template <typename Key>
+void id_map<Key>::assign(std::vector<entry> entries) {
+  std::vector<std::shared_ptr<shard>> shards(shard_count);
+
+  for (const auto& e : entries) {
+    auto& s = shards[shard_of(e.key)];
+    if (!s)
+      s = std::make_shared<shard>();
+
+    s->push_back(e);
+  }
+
+  for (auto& s : shards) {
+    if (!s)
+      continue;
+
+    std::sort(s->begin(), s->end(), [](const entry& a, const entry& b) { return a.key < b.key; });
+    s->erase(std::unique(s->begin(), s->end(), [](const entry& a, const entry& b) { return a.key == b.key; }), s->end());
+  }
+
+  shards_ = std::move(shards);
+}
+
+// Saved as one flat array of entries, in shard order.
+template <typename Key>
+void id_map<Key>::save(snapshot_writer& writer) const {
+  std::vector<entry> entries;
+
+  for (const auto& s : shards_) {
+    if (s)
+      entries.insert(entries.end(), s->begin(), s->end());
+  }
+
+  writer.write(entries);
+}
+
+template <typename Key>
+void id_map<Key>::load(snapshot_reader& reader) {
+  std::vector<entry> entries;
+  reader.read(entries);
+  assign(std::move(entries));
+}
+
+template class id_map<postId>;
+template class id_map<md5_digest>;
+
+arena_pool::lease arena_pool::acquire() {
+  {
+    std::lock_guard lock(mutex_);
+
+    if (!free_.empty()) {
+      auto arena = std::move(free_.back());
+      free_.pop_back();
+      return lease(*this, std::move(arena));
+    }
+  }
+
+  arenas_++;
+  allocations_++;
+  return lease(*this, std::make_unique<query_arena>());
+}
+
+void arena_pool::release(std::unique_ptr<query_arena> arena) {
+  std::lock_guard lock(mutex_);
+  free_.push_back(std::move(arena));
+}
+
+arena_pool::stats arena_pool::getStats() const {
+  return { arenas_, allocations_, bytes_ };
+}
+
+// Grow with some headroom, so that an index growing a chunk at a time doesn't
+// reallocate the arenas on every query.
+Score* arena_pool::lease::scores(size_t n) {
+  auto& scores = arena_->scores;
+
+  if (scores.size() < n) {
+    const size_t old_size = scores.size();
+    scores.resize(std::max(n, old_size + old_size / 4));
+
+    pool_->allocations_++;
+    pool_->bytes_ += (scores.size() - old_size) * sizeof(Score);
+  }
+
+  return scores.data();
 }
 
-void bucket_set::eachBucket(const HaarSignature &sig, std::function<void(bucket_t&)> func) {
-  for (int c = 0; c < sig.num_colors(); c++) {
-    for (int i = 0; i < NUM_COEFS; i++) {
-      const int coef = sig.sig[c][i];
-      auto& bucket = at(c, coef);
-      func(bucket);
+std::vector<sim_vector>& arena_pool::lease::heaps(size_t n, size_t numres, size_t shard_size) {
+  auto& heaps = arena_->heaps;
+
+  // A heap never holds more results than there are images in the shard, and
+  // the arena keeps its capacity, so don't let a huge limit reserve more.
+  numres = std::min(numres, shard_size);
+
+  if (heaps.size() < n)
+    heaps.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    heaps[i].clear();
+
+    if (heaps[i].capacity() < numres) {
+      const size_t old_capacity = heaps[i].capacity();
+      heaps[i].reserve(numres);
+
+      pool_->allocations_++;
+      pool_->bytes_ += (heaps[i].capacity() - old_capacity) * sizeof(sim_value);
     }
   }
+
+  return heaps;
+}
+
+std::shared_ptr<const IQDB::index_state> IQDB::state() const {
+  return std::atomic_load(&state_);
+}
+
+std::shared_ptr<IQDB::index_state> IQDB::emptyState() const {
+  auto next = std::make_shared<index_state>();
+  next->metadata = image_metadata(cache_signatures_);
+  return next;
+}
+
+template <typename F>
+void IQDB::update(F func) {
+  auto next = std::make_shared<index_state>(*state());
+  func(*next);
+  std::atomic_store(&state_, std::shared_ptr<const index_state>(std::move(next)));
+}
+
+template <typename F>
+void IQDB::write(F func) {
+  auto next = std::make_shared<index_state>(*state());
+  std::vector<QueuedWrite> writes;
+  func(*next, writes);
+  
+  if (writes.empty())
+    return;
+  
+  const auto added = static_cast<size_t>(std::count_if(writes.begin(), writes.end(), [](const auto& w) { return w.type == QueuedWrite::add; }));
+  
+  if (commit_delay_.count() == 0) {
+    // The index and the store disagree, so don't publish an index the store
+    // doesn't match.
+    try {
+      store_->applyWrites(writes);
+    } catch (const store_conflict& e) {
+      store_conflicts_++;
+      ERROR("The image store refused a change the index allowed: {}.\n", e.what());
+      throw;
+    }
+
+    last_post_id = store_->getMaxPostId();
+  } else {
+    for (const auto& w : writes) {
+      if (w.type == QueuedWrite::add && w.post_id > last_post_id)
+        last_post_id = w.post_id;
+    }
+  }
+  
+  image_count_ += added - (writes.size() - added);
+  std::atomic_store(&state_, std::shared_ptr<const index_state>(std::move(next)));
+  
+  if (commit_delay_.count() > 0)
+    queueWrites(std::move(writes));
+}
+
+AddedImage IQDB::addImageTo(index_state& state, const NewImage& image, bool replace_img, std::vector<QueuedWrite>& writes) {
+  const auto old_id = state.post_ids.find(image.post_id);
+  if (old_id && !replace_img)
+    return { -1, std::nullopt };
+  
+  const auto digest = md5FromHex(image.md5);
+  const auto md5_id = digest ? state.md5s.find(*digest) : std::nullopt;
+  if (md5_id && md5_id != old_id)
+    return { -2, std::nullopt };
+  
+  if (old_id) {
+    removeImageInMemory(state, *old_id);
+    writes.push_back({ QueuedWrite::remove, *old_id, image.post_id });
+  }
+  
+  const iqdbId iqdb_id = next_id_++;
+  addImageInMemory(state, iqdb_id, image.post_id, image.md5, image.signature);
+  writes.push_back({ QueuedWrite::add, iqdb_id, image.post_id, image.md5, image.signature });
+  
+  return { static_cast<int>(iqdb_id), old_id };
 }
 
 void IQDB::addImage(imageId post_id, const std::string& md5, const HaarSignature& haar, bool replace_img) {
+  std::lock_guard lock(write_mutex_);
+  int iqdb_id = 0;
   
-  if (replace_img)
-    removeImage(post_id);
+  write([&](index_state& state, std::vector<QueuedWrite>& writes) {
+    iqdb_id = addImageTo(state, { post_id, md5, haar }, replace_img, writes).id;
+  });
   
-  int iqdb_id = sqlite_db_->addImage(post_id, md5, haar, replace_img);
-  // fail to insert into sqlite db
   if (iqdb_id == -1) { // post_id unique constraint failed
-    // current last_post_id may be out dated, update it
-    last_post_id = sqlite_db_->getMaxPostId();
-    
     DEBUG("post_id UNIQUE constrain failed. post_id={}, md5={}\n", post_id, md5);
     throw image_error("post_id UNIQUE constrain failed, this post_id already in database.");
   }
@@ -81,174 +453,800 @@ void IQDB::addImage(imageId post_id, const std::string& md5, const HaarSignature
     DEBUG("MD5 UNIQUE constrain failed. post_id={}, md5={}\n", post_id, md5);
     throw image_error("MD5 UNIQUE constrain failed, this MD5 already in database.");
   }
-  addImageInMemory(iqdb_id, post_id, haar);
-  
-  last_post_id++;
   
   DEBUG("Added post #{} to memory and database (iqdb={} md5={} haar={}).\n", post_id, iqdb_id, md5, haar.to_string());
 }
 
-void IQDB::addImageInMemory(imageId iqdb_id, imageId post_id, const HaarSignature& haar) {
-  if ((size_t)post_id >= m_info.size()) {
-    DEBUG("Growing m_info array (size={}).\n", m_info.size());
-    m_info.resize(post_id + 50000);
+std::vector<std::string> IQDB::addImages(const std::vector<NewImage>& images) {
+  std::lock_guard lock(write_mutex_);
+  std::vector<std::string> errors(images.size());
+  
+  write([&](index_state& state, std::vector<QueuedWrite>& writes) {
+    for (size_t i = 0; i < images.size(); i++) {
+      const auto added = addImageTo(state, images[i], true, writes);
+      
+      if (added.id == -1) {
+        errors[i] = "post_id UNIQUE constrain failed, this post_id already in database.";
+      } else if (added.id == -2) {
+        errors[i] = "MD5 UNIQUE constrain failed, this MD5 already in database.";
+      }
+    }
+  });
+  
+  DEBUG("Added {} images to memory and database.\n", std::count(errors.begin(), errors.end(), ""));
+  return errors;
+}
+
+void IQDB::queueWrites(std::vector<QueuedWrite>&& writes) {
+  {
+    std::lock_guard lock(queue_mutex_);
+    if (queued_writes_.empty())
+      first_queued_ = std::chrono::steady_clock::now();
+    
+    queued_writes_.insert(queued_writes_.end(), std::make_move_iterator(writes.begin()), std::make_move_iterator(writes.end()));
+  }
+  
+  queue_cv_.notify_one();
+}
+
+void IQDB::flush() {
+  std::lock_guard commit_lock(commit_mutex_);
+  
+  {
+    std::lock_guard lock(queue_mutex_);
+    if (queued_writes_.empty())
+      return;
+    
+    committing_.swap(queued_writes_);
+  }
+  
+  // Put the writes after the first `committed` back in front of whatever was
+  // queued since, so they're retried in order.
+  const auto requeue = [&](size_t committed) {
+    std::lock_guard lock(queue_mutex_);
+    committing_.erase(committing_.begin(), committing_.begin() + static_cast<ptrdiff_t>(committed));
+    committing_.insert(committing_.end(), std::make_move_iterator(queued_writes_.begin()), std::make_move_iterator(queued_writes_.end()));
+    queued_writes_.swap(committing_);
+    committing_.clear();
+  };
+
+  try {
+    store_->applyWrites(committing_);
+  } catch (const store_conflict& e) {
+    // The index already has these writes, so commit the ones the store will
+    // take one at a time, and drop the rest.
+    ERROR("The image store refused a batch of {} queued writes the index allowed: {}. Committing them one at a time.\n", committing_.size(), e.what());
+
+    for (size_t i = 0; i < committing_.size(); i++) {
+      try {
+        store_->applyWrites({ committing_[i] });
+      } catch (const store_conflict& conflict) {
+        store_conflicts_++;
+        ERROR("Dropped a queued write: {}.\n", conflict.what());
+      } catch (...) {
+        requeue(i);
+        throw;
+      }
+    }
+  } catch (...) {
+    requeue(0);
+    throw;
+  }
+  
+  std::lock_guard lock(queue_mutex_);
+  DEBUG("Committed {} queued writes.\n", committing_.size());
+  committing_.clear();
+}
+
+void IQDB::commitLoop() {
+  std::unique_lock lock(queue_mutex_);
+  
+  while (true) {
+    queue_cv_.wait(lock, [&] { return stopping_ || !queued_writes_.empty(); });
+    queue_cv_.wait_until(lock, first_queued_ + commit_delay_, [&] { return stopping_ || queued_writes_.size() >= commit_rows_; });
+    
+    // The destructor flushes whatever is left.
+    if (stopping_)
+      return;
+    
+    lock.unlock();
+    
+    try {
+      flush();
+    } catch (const std::exception& e) {
+      ERROR("Couldn't commit queued writes: {}. Retrying in {} ms.\n", e.what(), commit_delay_.count());
+    }
+    
+    lock.lock();
+    first_queued_ = std::chrono::steady_clock::now();
   }
+}
+
+void IQDB::addImageInMemory(index_state& state, imageId iqdb_id, imageId post_id, const std::string& md5, const HaarSignature& haar) {
+  if ((size_t)iqdb_id >= state.images.size()) {
+    DEBUG("Growing image table (size={}).\n", state.images.size());
+    state.images.resize(iqdb_id + 50000);
+  }
+  
+  if ((size_t)iqdb_id >= state.metadata.size())
+    state.metadata.resize(iqdb_id + 50000);
+  
+  const auto digest = md5FromHex(md5);
   
-  imgbuckets.add(haar, iqdb_id);
+  state.buckets.add(haar, iqdb_id);
+  state.images.set(iqdb_id, post_id, haar);
+  state.metadata.set(iqdb_id, digest.value_or(md5_digest{}), haar);
+  state.post_ids.insert(post_id, iqdb_id);
   
-  image_info& info = m_info.at(iqdb_id);
-  info.id = post_id;
-  info.avgl.v[0] = static_cast<Score>(haar.avglf[0]);
-  info.avgl.v[1] = static_cast<Score>(haar.avglf[1]);
-  info.avgl.v[2] = static_cast<Score>(haar.avglf[2]);
+  if (digest)
+    state.md5s.insert(*digest, iqdb_id);
+}
+
+void IQDB::removeImageInMemory(index_state& state, imageId iqdb_id) {
+  state.post_ids.erase(state.images.postIdOf(iqdb_id), iqdb_id);
+  state.md5s.erase(state.metadata.md5Of(iqdb_id), iqdb_id);
+  state.buckets.remove(iqdb_id);
+  state.images.erase(iqdb_id);
+}
+
+// A bounded queue of image batches, passed from the thread reading the
+// database to the threads building the index.
+class batch_queue {
+public:
+  explicit batch_queue(size_t capacity) : capacity_(capacity) {}
+
+  // Wait for room in the queue, then add the batch. Returns false, and drops
+  // the batch, if the queue was closed.
+  bool push(std::vector<Image>&& batch) {
+    std::unique_lock lock(mutex_);
+    not_full_.wait(lock, [&] { return closed_ || queue_.size() < capacity_; });
+
+    if (closed_)
+      return false;
+
+    queue_.push_back(std::move(batch));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Wait for the next batch. Returns false once the queue is closed and empty.
+  bool pop(std::vector<Image>& batch) {
+    std::unique_lock lock(mutex_);
+    not_empty_.wait(lock, [&] { return closed_ || !queue_.empty(); });
+
+    if (queue_.empty())
+      return false;
+
+    batch = std::move(queue_.front());
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard lock(mutex_);
+    closed_ = true;
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+private:
+  const size_t capacity_;
+  std::deque<std::vector<Image>> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  bool closed_ = false;
+};
+
+template <typename T>
+static std::vector<T> concat(std::vector<std::vector<T>>&& parts) {
+  std::vector<T> all = std::move(parts[0]);
+
+  for (size_t i = 1; i < parts.size(); i++) {
+    all.insert(all.end(), parts[i].begin(), parts[i].end());
+    parts[i] = {};
+  }
+
+  return all;
+}
+
+// Build the index from the database. The calling thread reads the images in
+// id order and hands them out in batches to the loader threads, which decode
+// the signatures and fill in the buckets and the image table. Each thread
+// gets its batches in increasing id order, so its partial bucket lists stay
+// sorted and can simply be merged at the end. The post id and md5 maps are
+// built from the entries each thread collects, once they're all done.
+void IQDB::loadImages(index_state& state) {
+  const size_t batch_size = 10000;
+  const size_t progress_interval = 250000;
+  const auto start = std::chrono::steady_clock::now();
+
+  state.images.resize(store_->getMaxId() + 1);
+  state.metadata.resize(store_->getMaxId() + 1);
+
+  bucket_builder builder(load_threads_);
+  std::vector<std::vector<id_map<postId>::entry>> post_ids(load_threads_);
+  std::vector<std::vector<id_map<md5_digest>::entry>> md5s(load_threads_);
+  batch_queue queue(2 * load_threads_);
+  std::atomic<size_t> loaded = 0;
+  std::vector<std::exception_ptr> errors(load_threads_ + 1);
+  std::vector<std::thread> workers;
+
+  auto elapsed = [&] {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  for (size_t t = 0; t < load_threads_; t++) {
+    workers.emplace_back([&, t] {
+      try {
+        std::vector<Image> batch;
+
+        while (queue.pop(batch)) {
+          for (const auto& image : batch) {
+            const auto& haar = image.haar;
+            const auto digest = md5FromHex(image.md5);
+            builder.add(t, haar, image.id);
+            state.images.set(image.id, image.post_id, haar);
+            state.metadata.set(image.id, digest.value_or(md5_digest{}), haar);
+            post_ids[t].push_back({ image.post_id, image.id });
+
+            if (digest)
+              md5s[t].push_back({ *digest, image.id });
+          }
+
+          const size_t before = loaded.fetch_add(batch.size());
+          const size_t after = before + batch.size();
+          if (before / progress_interval != after / progress_interval) {
+            INFO("Loaded {} images ({:.0f} images/sec)...\n", after, static_cast<double>(after) / elapsed());
+          }
+        }
+      } catch (...) {
+        errors[t + 1] = std::current_exception();
+        queue.close();
+      }
+    });
+  }
+
+  try {
+    std::vector<Image> batch;
+    batch.reserve(batch_size);
+
+    store_->eachImage([&](const auto& image) {
+      if ((size_t)image.id >= state.images.size())
+        throw fatal_error("Image id " + std::to_string(image.id) + " is larger than the max id");
+
+      batch.push_back(image);
+
+      if (batch.size() == batch_size) {
+        queue.push(std::move(batch));
+        batch.clear();
+        batch.reserve(batch_size);
+      }
+    });
+
+    queue.push(std::move(batch));
+  } catch (...) {
+    errors[0] = std::current_exception();
+  }
+
+  queue.close();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  for (auto& error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  state.buckets.reset(builder.build());
+  state.post_ids.assign(concat(std::move(post_ids)));
+  state.md5s.assign(concat(std::move(md5s)));
+
+  const double seconds = elapsed();
+  INFO("Built index of {} images with {} threads in {:.1f} seconds ({:.0f} images/sec).\n", loaded.load(), load_threads_, seconds, static_cast<double>(loaded.load()) / seconds);
 }
 
 void IQDB::loadDatabase(std::string filename) {
-  sqlite_db_ = std::make_unique<SqliteDB>(filename);
-  m_info.clear();
-  imgbuckets = bucket_set();
+  {
+    std::lock_guard lock(write_mutex_);
+    if (store_)
+      flush();
+
+    if (storage_ == "sqlite")
+      store_ = std::make_unique<SqliteDB>(filename, sqlite_options_);
+    else if (storage_ == "log")
+      store_ = std::make_unique<LogDB>(filename, log_options_);
+    else
+      throw param_error("Invalid storage type '" + storage_ + "'; must be sqlite or log");
 
-  sqlite_db_->eachImage([&](const auto& image) {
-    addImageInMemory(image.id, image.post_id, image.haar());
+    image_count_ = static_cast<size_t>(store_->getImgCount());
+    next_id_ = store_->getMaxId() + 1;
+    last_post_id = store_->getMaxPostId();
 
-    if (image.id % 250000 == 0) {
-      INFO("Loaded image {} (post #{})...\n", image.id, image.post_id);
+    if (!snapshot_filename_.empty()) {
+      try {
+        auto next = emptyState();
+        loadSnapshot(*next);
+        std::atomic_store(&state_, std::shared_ptr<const index_state>(std::move(next)));
+
+        INFO("Loaded {} images from snapshot {}.\n", getImgCount(), snapshot_filename_);
+        return;
+      } catch (const snapshot_error& e) {
+        WARN("{}. Loading from {} instead.\n", e.what(), filename);
+      }
     }
-  });
+
+    auto next = emptyState();
+    loadImages(*next);
+    std::atomic_store(&state_, std::shared_ptr<const index_state>(std::move(next)));
+  }
 
   INFO("Loaded {} images from {}.\n", getImgCount(), filename);
+
+  if (!snapshot_filename_.empty()) {
+    try {
+      saveSnapshot();
+    } catch (const snapshot_error& e) {
+      WARN("{}.\n", e.what());
+    }
+  }
+}
+
+// Load the index from the snapshot, if it was taken from the database as it
+// is now. The row count and max id change on every add or remove.
+void IQDB::loadSnapshot(index_state& state) {
+  snapshot_reader reader(snapshot_filename_);
+  const auto& header = reader.header();
+
+  if (header.image_count != static_cast<uint64_t>(store_->getImgCount()) || header.max_id != store_->getMaxId())
+    throw snapshot_error("Snapshot " + snapshot_filename_ + " is out of date");
+
+  state.images.load(reader);
+  state.metadata.load(reader);
+  state.post_ids.load(reader);
+  state.md5s.load(reader);
+  state.buckets.load(reader);
+}
+
+void IQDB::saveSnapshot() {
+  if (snapshot_filename_.empty())
+    return;
+
+  // Hold the write lock until the snapshot is written, so that it matches
+  // the row count and max id it's stamped with.
+  std::lock_guard lock(write_mutex_);
+  flush();
+  update([](index_state& state) {
+    state.buckets.install(state.buckets.merge());
+  });
+
+  const auto current = state();
+  snapshot_writer writer(snapshot_filename_);
+  current->images.save(writer);
+  current->metadata.save(writer);
+  current->post_ids.save(writer);
+  current->md5s.save(writer);
+  current->buckets.save(writer);
+  writer.commit(store_->getImgCount(), store_->getMaxId());
+
+  INFO("Saved snapshot {}.\n", snapshot_filename_);
+}
+
+size_t IQDB::getPendingBucketIds() {
+  return state()->buckets.deltaSize();
+}
+
+size_t IQDB::getPendingRemovals() {
+  return state()->buckets.removedSize();
+}
+
+bucket_merge IQDB::mergeBuckets() {
+  return state()->buckets.merge();
+}
+
+bool IQDB::installBuckets(bucket_merge merge) {
+  std::lock_guard lock(write_mutex_);
+
+  if (!state()->buckets.canInstall(merge))
+    return false;
+
+  update([&](index_state& state) {
+    state.buckets.install(std::move(merge));
+  });
+
+  return true;
 }
 
 bool IQDB::isDeleted(imageId iqdb_id) {
-  return !m_info.at(iqdb_id).avgl.v[0];
+  return state()->images.isDeleted(iqdb_id);
+}
+
+std::optional<IndexedImage> IQDB::getImage(postId post_id) {
+  const auto current = state();
+  const auto iqdb_id = current->post_ids.find(post_id);
+
+  if (!iqdb_id)
+    return std::nullopt;
+
+  return indexedImage(*current, *iqdb_id);
 }
 
-std::optional<Image> IQDB::getImage(imageId post_id) {
-  return sqlite_db_->getImage(post_id);
+std::optional<IndexedImage> IQDB::getImageByMD5(const std::string& md5) {
+  const auto current = state();
+  const auto digest = md5FromHex(md5);
+  const auto iqdb_id = digest ? current->md5s.find(*digest) : std::nullopt;
+
+  if (!iqdb_id)
+    return std::nullopt;
+
+  return indexedImage(*current, *iqdb_id);
 }
 
-std::optional<Image> IQDB::getImageByMD5(const std::string& md5) {
-  return sqlite_db_->getImageByMD5(md5);
+std::optional<IndexedImage> IQDB::indexedImage(const index_state& state, iqdbId iqdb_id) {
+  const postId post_id = state.images.postIdOf(iqdb_id);
+  const md5_digest& md5 = state.metadata.md5Of(iqdb_id);
+  const HaarSignature* haar = state.metadata.signatureOf(iqdb_id);
+
+  if (haar && md5 != md5_digest{})
+    return IndexedImage{ iqdb_id, post_id, md5ToHex(md5), *haar };
+
+  // An image that hasn't been committed yet is only in the queue.
+  {
+    std::lock_guard lock(queue_mutex_);
+    for (const auto* writes : { &queued_writes_, &committing_ }) {
+      for (const auto& w : *writes) {
+        if (w.type == QueuedWrite::add && w.id == iqdb_id)
+          return IndexedImage{ w.id, w.post_id, w.md5, w.signature };
+      }
+    }
+  }
+
+  const auto image = store_->getImageById(iqdb_id);
+  if (!image)
+    return std::nullopt;
+
+  return IndexedImage{ image->id, image->post_id, image->md5, image->haar };
 }
 
-sim_vector IQDB::queryFromBlob(const std::string blob, int numres) {
+sim_vector IQDB::queryFromBlob(std::string_view blob, int numres) {
   HaarSignature signature = HaarSignature::from_file_content(blob);
   return queryFromSignature(signature, numres);
 }
 
-sim_vector IQDB::queryFromSignature(const HaarSignature &signature, size_t numres) {
+// The score an image would get if it had every coefficient of the query,
+// inverted, for turning scores into percentages.
+static Score queryScale(const bucket_set& buckets, const HaarSignature &signature) {
   Score scale = 0;
-  std::vector<Score> scores(m_info.size(), 0);
-  std::priority_queue<sim_value> pqResults; /* results priority queue; largest at top */
-  sim_vector V; /* output results */
+
+  for (int c = 0; c < signature.num_colors(); c++) {
+    for (int b = 0; b < NUM_COEFS; b++) {
+      const int coef = signature.sig[c][b];
+
+      if (!buckets.at(c, coef).empty())
+        scale -= weights[imgBin.bin[abs(coef)]][c];
+    }
+  }
+
+  if (scale != 0)
+    scale = static_cast<Score>(1.0) / scale;
+
+  return scale;
+}
+
+// Merge the per-shard results of a query, keeping the best (lowest) scores,
+// and turn their iqdb ids and raw scores into post ids and percentages.
+static sim_vector finishQuery(const image_table& images, const std::vector<sim_vector>& shards, size_t numres, Score scale) {
+  sim_vector V;
+
+  for (const auto& results : shards) {
+    V.insert(V.end(), results.begin(), results.end());
+  }
+
+  const size_t n_results = std::min(numres, V.size());
+  std::partial_sort(V.begin(), V.begin() + n_results, V.end());
+  V.erase(V.begin() + n_results, V.end());
+
+  for (auto& value : V) {
+    value.id = images.postIdOf(value.id); // XXX replace iqdb id with post id
+    value.score = value.score * 100 * scale;
+  }
+
+  return V;
+}
+
+// Offer a result to a max-heap holding the best (lowest) `numres` scores.
+static void pushResult(sim_vector& heap, size_t numres, imageId id, Score score) {
+  if (heap.size() < numres) {
+    heap.emplace_back(id, score);
+    std::push_heap(heap.begin(), heap.end());
+  } else if (score < heap.front().score) {
+    std::pop_heap(heap.begin(), heap.end());
+    heap.back() = sim_value(id, score);
+    std::push_heap(heap.begin(), heap.end());
+  }
+}
+
+// Empty a results heap into a new vector, largest score first.
+static sim_vector popResults(sim_vector& heap) {
+  sim_vector V;
+  V.reserve(heap.size());
+
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end());
+    V.push_back(heap.back());
+    heap.pop_back();
+  }
+
+  return V;
+}
+
+template <typename F>
+auto IQDB::runShards(const index_state& state, F func) -> std::vector<decltype(func(0, 0))> {
+  const size_t n_images = state.images.size();
+  const size_t n_shards = std::max<size_t>(1, std::min(query_threads_, n_images / min_shard_size));
+  const size_t shard_size = (n_images + n_shards - 1) / n_shards;
+  std::vector<std::future<decltype(func(0, 0))>> shards;
+  std::vector<decltype(func(0, 0))> results;
+
+  for (size_t s = 1; s < n_shards; s++) {
+    const iqdbId begin = static_cast<iqdbId>(std::min(n_images, s * shard_size));
+    const iqdbId end = static_cast<iqdbId>(std::min(n_images, (s + 1) * shard_size));
+
+    shards.push_back(query_pool_->submit([&func, begin, end] {
+      return func(begin, end);
+    }));
+  }
+
+  results.push_back(func(0, static_cast<iqdbId>(std::min(n_images, shard_size))));
+
+  // Wait for every shard before calling get(), so that no task outlives
+  // the arguments it captured by reference if one of them threw.
+  for (auto& shard : shards)
+    shard.wait();
+
+  for (auto& shard : shards)
+    results.push_back(shard.get());
+
+  return results;
+}
+
+sim_vector IQDB::queryFromSignature(const HaarSignature &signature, size_t numres) {
+  const auto current = state();
 
   DEBUG("Querying signature={} json={}\n", signature.to_string(), signature.to_json());
 
-  // Luminance score (DC coefficient).
-  for (size_t i = 0; i < scores.size(); i++) {
-    auto image_info = m_info[i];
-    Score s = 0;
+  if (numres == 0)
+    return {};
+
+  const auto shards = runShards(*current, [&](iqdbId begin, iqdbId end) {
+    return queryShard(*current, signature, numres, begin, end);
+  });
+
+  return finishQuery(current->images, shards, numres, queryScale(current->buckets, signature));
+}
+
+std::vector<sim_vector> IQDB::queryFromSignatures(const std::vector<HaarSignature>& signatures, size_t numres) {
+  const auto current = state();
+  std::vector<sim_vector> results;
+
+  DEBUG("Querying {} signatures\n", signatures.size());
+
+  if (numres == 0)
+    return std::vector<sim_vector>(signatures.size());
 
-    for (int c = 0; c < signature.num_colors(); c++) {
-      s += weights[0][c] * std::abs(image_info.avgl.v[c] - static_cast<Score>(signature.avglf[c]));
+  for (size_t first = 0; first < signatures.size(); first += max_batch_queries) {
+    const std::vector<HaarSignature> group(signatures.begin() + static_cast<std::ptrdiff_t>(first), signatures.begin() + static_cast<std::ptrdiff_t>(std::min(signatures.size(), first + max_batch_queries)));
+
+    const auto shards = runShards(*current, [&](iqdbId begin, iqdbId end) {
+      return queryShardBatch(*current, group, numres, begin, end);
+    });
+
+    for (size_t q = 0; q < group.size(); q++) {
+      std::vector<sim_vector> query_shards;
+
+      for (const auto& shard : shards)
+        query_shards.push_back(shard[q]);
+
+      results.push_back(finishQuery(current->images, query_shards, numres, queryScale(current->buckets, group[q])));
     }
+  }
 
-    scores[i] = s;
+  return results;
+}
+
+sim_vector IQDB::queryShard(const index_state& state, const HaarSignature &signature, size_t numres, iqdbId begin, iqdbId end) {
+  auto arena = arenas_.acquire();
+  Score* const scores = arena.scores(end - begin);
+  sim_vector& heap = arena.heaps(1, numres, end - begin)[0]; /* results heap; largest at top */
+
+  // Luminance score (DC coefficient), one chunk of the image table at a time.
+  const Score query_avgl[3] = { static_cast<Score>(signature.avglf[0]), static_cast<Score>(signature.avglf[1]), static_cast<Score>(signature.avglf[2]) };
+  for (size_t i = begin; i < end;) {
+    const auto& chunk = state.images.chunkAt(i / image_table::chunk_size);
+    const size_t offset = i % image_table::chunk_size;
+    const size_t n = std::min<size_t>(end - i, image_table::chunk_size - offset);
+    const Score* const avgl[3] = { chunk.avgl[0] + offset, chunk.avgl[1] + offset, chunk.avgl[2] + offset };
+
+    luminance_scores(avgl, signature.num_colors(), query_avgl, scores + (i - begin), n);
+    i += n;
   }
 
   for (int c = 0; c < signature.num_colors(); c++) {
     for (int b = 0; b < NUM_COEFS; b++) { // for every coef on a sig
       const int coef = signature.sig[c][b];
-      auto &bucket = imgbuckets.at(c, coef);
+      const auto bucket = state.buckets.at(c, coef);
 
       if (bucket.empty())
         continue;
 
       const int w = imgBin.bin[abs(coef)];
       Score weight = weights[w][c];
-      scale -= weight;
 
-      for (auto index : bucket) {
-        scores[index] -= weight;
-      }
+      bucket.each(begin, end, [&](uint32_t id) {
+        scores[id - begin] -= weight;
+      });
     }
   }
 
-  // Fill up the numres-bounded priority queue (largest at top):
-  iqdbId i = 0;
-  for (; pqResults.size() < numres && i < scores.size(); i++) {
-    if (!isDeleted(i))
-      pqResults.emplace(i, scores[i]);
+  for (iqdbId i = begin; i < end; i++) {
+    if (!state.images.isDeleted(i))
+      pushResult(heap, numres, i, scores[i - begin]);
   }
 
-  for (; i < scores.size(); i++) {
-    if (!isDeleted(i) && scores[i] < pqResults.top().score) {
-      pqResults.pop();
-      pqResults.emplace(i, scores[i]);
-    }
+  return popResults(heap);
+}
+
+std::vector<sim_vector> IQDB::queryShardBatch(const index_state& state, const std::vector<HaarSignature>& signatures, size_t numres, iqdbId begin, iqdbId end) {
+  const size_t n_queries = signatures.size();
+  auto arena = arenas_.acquire();
+  Score* const scores = arena.scores(n_queries * batch_tile_size); // One row of batch_tile_size scores per query.
+  auto& heaps = arena.heaps(n_queries, numres, end - begin); /* results heaps; largest at top */
+  std::array<std::array<Score, 3>, max_batch_queries> query_avgl;
+  std::vector<sim_vector> V(n_queries); /* output results */
+
+  for (size_t q = 0; q < n_queries; q++) {
+    const auto& avglf = signatures[q].avglf;
+    query_avgl[q] = { static_cast<Score>(avglf[0]), static_cast<Score>(avglf[1]), static_cast<Score>(avglf[2]) };
   }
 
-  if (scale != 0)
-    scale = static_cast<Score>(1.0) / scale;
+  for (size_t tile = begin; tile < end; tile += batch_tile_size) {
+    const size_t tile_end = std::min<size_t>(end, tile + batch_tile_size);
 
-  while (!pqResults.empty()) {
-    auto value = pqResults.top();
-    value.id = m_info[value.id].id; // XXX replace iqdb id with post id
-    value.score = value.score * 100 * scale;
+    // Luminance score (DC coefficient). Score every query against a chunk
+    // of the image table while it's in cache, before moving on to the next.
+    for (size_t i = tile; i < tile_end;) {
+      const auto& chunk = state.images.chunkAt(i / image_table::chunk_size);
+      const size_t offset = i % image_table::chunk_size;
+      const size_t n = std::min<size_t>(tile_end - i, image_table::chunk_size - offset);
+      const Score* const avgl[3] = { chunk.avgl[0] + offset, chunk.avgl[1] + offset, chunk.avgl[2] + offset };
+
+      for (size_t q = 0; q < n_queries; q++) {
+        luminance_scores(avgl, signatures[q].num_colors(), query_avgl[q].data(), scores + q * batch_tile_size + (i - tile), n);
+      }
+
+      i += n;
+    }
+
+    // Bucket scores and top results, one query at a time. The coefficients
+    // are applied in the same order as in queryShard(), so every score comes
+    // out exactly the same.
+    for (size_t q = 0; q < n_queries; q++) {
+      const auto& signature = signatures[q];
+      Score* const tile_scores = scores + q * batch_tile_size;
+      auto& heap = heaps[q];
+
+      for (int c = 0; c < signature.num_colors(); c++) {
+        for (int b = 0; b < NUM_COEFS; b++) {
+          const int coef = signature.sig[c][b];
+          const auto bucket = state.buckets.at(c, coef);
+
+          if (bucket.empty())
+            continue;
+
+          const Score weight = weights[imgBin.bin[abs(coef)]][c];
+
+          bucket.each(static_cast<uint32_t>(tile), static_cast<uint32_t>(tile_end), [&](uint32_t id) {
+            tile_scores[id - tile] -= weight;
+          });
+        }
+      }
 
-    V.push_back(value);
-    pqResults.pop();
+      for (size_t i = tile; i < tile_end; i++) {
+        const imageId id = static_cast<imageId>(i);
+        const Score score = tile_scores[i - tile];
+
+        if (!state.images.isDeleted(id))
+          pushResult(heap, numres, id, score);
+      }
+    }
   }
 
-  std::reverse(V.begin(), V.end());
+  for (size_t q = 0; q < n_queries; q++)
+    V[q] = popResults(heaps[q]);
+
   return V;
 }
 
 bool IQDB::removeImage(imageId post_id) {
-  auto image = sqlite_db_->getImage(post_id);
-  if (image == std::nullopt) {
-    WARN("Couldn't remove post #{}; post not in sqlite database.\n", post_id);
+  std::lock_guard lock(write_mutex_);
+  return removeImageLocked(post_id);
+}
+
+bool IQDB::removeImageLocked(imageId post_id) {
+  const auto iqdb_id = state()->post_ids.find(post_id);
+  if (!iqdb_id) {
+    WARN("Couldn't remove post #{}; post not in database.\n", post_id);
     return false;
   }
   
-  imgbuckets.remove(image->haar(), image->id);
-  m_info.at(image->id).avgl.v[0] = 0;
-  sqlite_db_->removeImage(post_id);
-  
-  last_post_id--;
+  write([&](index_state& state, std::vector<QueuedWrite>& writes) {
+    removeImageInMemory(state, *iqdb_id);
+    writes.push_back({ QueuedWrite::remove, *iqdb_id, post_id });
+  });
   
   DEBUG("Removed post #{} from memory and database.\n", post_id);
   return true;
 }
 
 bool IQDB::removeImageByMD5(const std::string& md5) {
-  auto image = sqlite_db_->getImageByMD5(md5);
-  if (image == std::nullopt) {
-    WARN("Couldn't remove file with md5 {}; this md5 is not in sqlite database.\n", md5);
+  std::lock_guard lock(write_mutex_);
+  const auto current = state();
+  const auto digest = md5FromHex(md5);
+  const auto iqdb_id = digest ? current->md5s.find(*digest) : std::nullopt;
+  if (!iqdb_id) {
+    WARN("Couldn't remove file with md5 {}; this md5 is not in database.\n", md5);
     return false;
   }
   
-  imgbuckets.remove(image->haar(), image->id);
-  m_info.at(image->id).avgl.v[0] = 0;
-  sqlite_db_->removeImage(image->post_id);
-  
-  last_post_id--;
-  
-  DEBUG("Removed post #{} from memory and database.\n", image->post_id);
-  return true;
+  return removeImageLocked(current->images.postIdOf(*iqdb_id));
 }
 
 size_t IQDB::getImgCount() {
-  return sqlite_db_->getImgCount();
+  return image_count_;
+}
+
+size_t IQDB::getQueuedWrites() {
+  std::lock_guard lock(queue_mutex_);
+  return queued_writes_.size() + committing_.size();
 }
 
 postId IQDB::getLastPostId() {
   return last_post_id;
 }
 
-IQDB::IQDB(std::string filename) : sqlite_db_(nullptr) {
+IQDB::IQDB(std::string filename, const IQDBOptions& options) : state_(std::make_shared<const index_state>()), store_(nullptr), snapshot_filename_(options.snapshot_filename), query_threads_(std::max<size_t>(1, options.query_threads)),
+  load_threads_(options.load_threads ? options.load_threads : std::max<size_t>(1, std::thread::hardware_concurrency())), cache_signatures_(options.cache_signatures),
+  storage_(options.storage), sqlite_options_(options.sqlite), log_options_(options.log), commit_delay_(options.commit_delay_ms), commit_rows_(std::max<size_t>(1, options.commit_rows)) {
+  if (query_threads_ > 1)
+    query_pool_ = std::make_unique<ThreadPool>(query_threads_ - 1);
+
   loadDatabase(filename);
-  last_post_id = sqlite_db_->getMaxPostId();
+
+  if (commit_delay_.count() > 0)
+    commit_thread_ = std::thread([this] { commitLoop(); });
+}
+
+IQDB::~IQDB() {
+  if (commit_thread_.joinable()) {
+    {
+      std::lock_guard lock(queue_mutex_);
+      stopping_ = true;
+    }
+
+    queue_cv_.notify_all();
+    commit_thread_.join();
+  }
+
+  try {
+    flush();
+  } catch (const std::exception& e) {
+    ERROR("Lost {} queued writes: {}.\n", getQueuedWrites(), e.what());
+  } catch (...) {
+    ERROR("Lost {} queued writes: unknown error.\n", getQueuedWrites());
+  }
 }
 
 }
@@ -0,0 +1,375 @@
+/***************************************************************************\
+    imglib.cpp - iqdb bucket index
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+\**************************************************************************/
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include <iqdb/debug.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/imglib.h>
+
+namespace iqdb {
+
+posting_segment::posting_segment() : block_offsets_{0} {}
+
+void posting_segment::append(const uint32_t* ids, size_t n) {
+  for (size_t i = 0; i < n; i += block_size) {
+    const size_t count = std::min(block_size, n - i);
+    const size_t offset = data_.size();
+
+    data_.resize(offset + streamvbyte_max_bytes(count));
+    const size_t used = streamvbyte_encode(ids + i, count, ids[i], data_.data() + offset);
+    data_.resize(offset + used);
+
+    blocks_.push_back({ offset, ids[i], static_cast<uint32_t>(count) });
+  }
+
+  block_offsets_.push_back(blocks_.size());
+  lengths_.push_back(static_cast<uint32_t>(n));
+}
+
+void posting_segment::finish() {
+  data_.resize(data_.size() + streamvbyte_padding, 0);
+}
+
+void posting_segment::reserve(size_t bytes) {
+  data_.reserve(bytes + streamvbyte_padding);
+}
+
+void posting_segment::decode(size_t b, std::vector<uint32_t>& out) const {
+  out.resize(lengths_[b]);
+  uint32_t* p = out.data();
+
+  for (size_t i = block_offsets_[b]; i < block_offsets_[b + 1]; i++) {
+    const auto& block = blocks_[i];
+    streamvbyte_decode(data_.data() + block.offset, block.count, block.first, p);
+    p += block.count;
+  }
+}
+
+void posting_segment::save(snapshot_writer& writer) const {
+  writer.write(data_);
+  writer.write(blocks_);
+  writer.write(block_offsets_);
+  writer.write(lengths_);
+}
+
+void posting_segment::load(snapshot_reader& reader) {
+  reader.read(data_);
+  reader.read(blocks_);
+  reader.read(block_offsets_);
+  reader.read(lengths_);
+
+  // Check the tables are consistent with each other, so a bad snapshot
+  // can't make queries read out of bounds.
+  if (block_offsets_.empty() || lengths_.size() != block_offsets_.size() - 1 || block_offsets_.back() != blocks_.size() || data_.size() < streamvbyte_padding)
+    throw snapshot_error("Invalid snapshot: inconsistent bucket tables");
+
+  for (size_t b = 0; b < lengths_.size(); b++) {
+    if (block_offsets_[b] > block_offsets_[b + 1])
+      throw snapshot_error("Invalid snapshot: inconsistent bucket tables");
+
+    size_t count = 0;
+    for (size_t i = block_offsets_[b]; i < block_offsets_[b + 1]; i++) {
+      count += blocks_[i].count;
+    }
+
+    if (count != lengths_[b])
+      throw snapshot_error("Invalid snapshot: inconsistent bucket tables");
+  }
+
+  for (const auto& block : blocks_) {
+    const size_t available = data_.size() - streamvbyte_padding;
+
+    if (block.count > block_size || block.offset + (block.count + 3) / 4 > available ||
+        block.offset + streamvbyte_encoded_size(data_.data() + block.offset, block.count) > available)
+      throw snapshot_error("Invalid snapshot: bucket block out of range");
+  }
+}
+
+bool tombstone_set::contains(imageId id) const noexcept {
+  const size_t p = id / page_bits;
+  return p < pages_.size() && pages_[p] && pages_[p]->test(id % page_bits);
+}
+
+void tombstone_set::insert(imageId id) {
+  if (contains(id))
+    return;
+
+  const size_t p = id / page_bits;
+  if (p >= pages_.size())
+    pages_.resize(p + 1);
+
+  // Only this set can hand out new references to its pages, so a use count
+  // of one means no other set can see the page.
+  auto& bits = pages_[p];
+  if (!bits)
+    bits = std::make_shared<page>();
+  else if (bits.use_count() > 1)
+    bits = std::make_shared<page>(*bits);
+
+  bits->set(id % page_bits);
+  size_++;
+}
+
+tombstone_set tombstone_set::minus(const tombstone_set& earlier) const {
+  tombstone_set result;
+
+  for (size_t p = 0; p < pages_.size(); p++) {
+    const auto* earlier_page = p < earlier.pages_.size() ? earlier.pages_[p].get() : nullptr;
+    if (!pages_[p] || pages_[p].get() == earlier_page)
+      continue;
+
+    auto added = std::make_shared<page>(*pages_[p]);
+    if (earlier_page)
+      *added &= ~*earlier_page;
+    if (added->none())
+      continue;
+
+    result.pages_.resize(p + 1);
+    result.size_ += added->count();
+    result.pages_[p] = std::move(added);
+  }
+
+  return result;
+}
+
+bucket_set::bucket_set() : delta_(n_pages) {
+  auto segment = std::make_shared<posting_segment>();
+
+  for (size_t b = 0; b < n_buckets; b++) {
+    segment->append(nullptr, 0);
+  }
+
+  segment->finish();
+  frozen_ = std::move(segment);
+}
+
+size_t bucket_set::index(int color, int coef) {
+  const size_t sign = coef < 0;
+  return (color * n_signs + sign) * n_indexes + static_cast<size_t>(abs(coef));
+}
+
+const bucket_t* bucket_set::delta(size_t b) const {
+  const auto& page = delta_[b / page_size];
+  return page ? (*page)[b % page_size].get() : nullptr;
+}
+
+bucket_t& bucket_set::mutableDelta(size_t b) {
+  // Only this set can hand out new references to its pages, so a use count
+  // of one means no other set can see the page.
+  auto& page = delta_[b / page_size];
+  if (!page)
+    page = std::make_shared<delta_page>();
+  else if (page.use_count() > 1)
+    page = std::make_shared<delta_page>(*page);
+
+  auto& bucket = (*page)[b % page_size];
+  if (!bucket)
+    bucket = std::make_shared<bucket_t>();
+  else if (bucket.use_count() > 1)
+    bucket = std::make_shared<bucket_t>(*bucket);
+
+  return *bucket;
+}
+
+bucket_ref bucket_set::at(int color, int coef) const {
+  const size_t b = index(color, coef);
+  bucket_ref bucket = { frozen_.get(), b, {} };
+
+  if (const bucket_t* delta_bucket = delta(b))
+    bucket.delta = { delta_bucket->data(), delta_bucket->data() + delta_bucket->size() };
+
+  return bucket;
+}
+
+void bucket_set::add(const HaarSignature &sig, imageId iqdb_id) {
+  // SQLite may hand out the id of a removed image again. The frozen segment
+  // is never changed in place, so merge the removed image's ids away before
+  // the id is reused, or the new image would inherit them. This only happens
+  // when the newest image is removed and another is added before the merge.
+  if (removed_.contains(iqdb_id)) {
+    DEBUG("Merging buckets before reusing removed id {}.\n", iqdb_id);
+    install(merge());
+  }
+
+  eachBucket(sig, [&](size_t b) {
+    auto& bucket = mutableDelta(b);
+
+    // Keep buckets sorted so queries can split them into shards with a binary
+    // search. New ids are almost always larger than every existing id.
+    if (bucket.empty() || bucket.back() < iqdb_id)
+      bucket.push_back(iqdb_id);
+    else
+      bucket.insert(std::lower_bound(bucket.begin(), bucket.end(), iqdb_id), iqdb_id);
+
+    delta_size_++;
+  });
+
+  version_++;
+}
+
+void bucket_set::remove(imageId iqdb_id) {
+  removed_.insert(iqdb_id);
+  version_++;
+}
+
+bucket_merge bucket_set::merge() const {
+  bucket_merge result = { std::make_unique<posting_segment>(), frozen_version_, version_, {}, removed_ };
+  auto& segment = result.segment;
+  std::vector<uint32_t> frozen, merged;
+  const auto is_removed = [&](uint32_t id) { return removed_.contains(id); };
+
+  segment->reserve(frozen_->dataSize() + streamvbyte_max_bytes(delta_size_));
+
+  for (size_t b = 0; b < n_buckets; b++) {
+    const bucket_t* delta_bucket = delta(b);
+    frozen_->decode(b, frozen);
+
+    if (delta_bucket) {
+      for (const auto id : *delta_bucket) {
+        if (id >= result.merged.size())
+          result.merged.resize(id + 1);
+        result.merged[id] = true;
+      }
+
+      merged.resize(frozen.size() + delta_bucket->size());
+      std::merge(frozen.begin(), frozen.end(), delta_bucket->begin(), delta_bucket->end(), merged.begin());
+    } else {
+      merged.swap(frozen);
+    }
+
+    if (!removed_.empty())
+      merged.erase(std::remove_if(merged.begin(), merged.end(), is_removed), merged.end());
+
+    segment->append(merged.data(), merged.size());
+  }
+
+  segment->finish();
+  return result;
+}
+
+bool bucket_set::install(bucket_merge merge) {
+  if (!canInstall(merge))
+    return false;
+
+  // Keep the ids that were added to the delta segment after the merge was
+  // taken. Everything else in it is in the merged segment now.
+  std::vector<std::shared_ptr<delta_page>> delta(n_pages);
+  size_t delta_size = 0;
+  const auto is_merged = [&](uint32_t id) { return id < merge.merged.size() && merge.merged[id]; };
+
+  for (size_t b = 0; b < n_buckets; b++) {
+    const bucket_t* delta_bucket = this->delta(b);
+    if (!delta_bucket || merge.version == version_)
+      continue;
+
+    bucket_t added;
+    std::remove_copy_if(delta_bucket->begin(), delta_bucket->end(), std::back_inserter(added), is_merged);
+    if (added.empty())
+      continue;
+
+    auto& page = delta[b / page_size];
+    if (!page)
+      page = std::make_shared<delta_page>();
+
+    delta_size += added.size();
+    (*page)[b % page_size] = std::make_shared<bucket_t>(std::move(added));
+  }
+
+  // Likewise, keep the tombstones of images removed after the merge was taken.
+  // Those images are still in the merged segment.
+  auto removed = removed_.minus(merge.removed);
+
+  frozen_ = std::move(merge.segment);
+  frozen_version_ = merge.version;
+  delta_ = std::move(delta);
+  delta_size_ = delta_size;
+  removed_ = std::move(removed);
+  return true;
+}
+
+void bucket_set::save(snapshot_writer& writer) const {
+  if (delta_size_ > 0 || removedSize() > 0)
+    throw snapshot_error("Can't save buckets with unmerged changes");
+
+  frozen_->save(writer);
+}
+
+void bucket_set::load(snapshot_reader& reader) {
+  posting_segment segment;
+  segment.load(reader);
+
+  if (segment.buckets() != n_buckets)
+    throw snapshot_error("Invalid snapshot: wrong number of buckets");
+
+  reset(std::move(segment));
+}
+
+void bucket_set::reset(posting_segment segment) {
+  frozen_ = std::make_shared<const posting_segment>(std::move(segment));
+  delta_.assign(n_pages, nullptr);
+  delta_size_ = 0;
+  removed_ = {};
+  frozen_version_ = ++version_;
+}
+
+void bucket_set::eachBucket(const HaarSignature &sig, std::function<void(size_t)> func) {
+  for (int c = 0; c < sig.num_colors(); c++) {
+    for (int i = 0; i < NUM_COEFS; i++) {
+      func(index(c, sig.sig[c][i]));
+    }
+  }
+}
+
+bucket_builder::bucket_builder(size_t threads) : partial_(threads, std::vector<bucket_t>(bucket_set::n_buckets)) {}
+
+void bucket_builder::add(size_t thread, const HaarSignature &sig, imageId iqdb_id) {
+  auto& buckets = partial_[thread];
+
+  bucket_set::eachBucket(sig, [&](size_t b) {
+    buckets[b].push_back(iqdb_id);
+  });
+}
+
+posting_segment bucket_builder::build() {
+  posting_segment segment;
+  std::vector<uint32_t> merged;
+
+  for (size_t b = 0; b < bucket_set::n_buckets; b++) {
+    merged.clear();
+
+    // Each thread's list is sorted, so append them one by one and merge
+    // each into the sorted prefix.
+    for (auto& buckets : partial_) {
+      const auto middle = merged.size();
+      merged.insert(merged.end(), buckets[b].begin(), buckets[b].end());
+      std::inplace_merge(merged.begin(), merged.begin() + static_cast<std::ptrdiff_t>(middle), merged.end());
+      bucket_t().swap(buckets[b]);
+    }
+
+    segment.append(merged.data(), merged.size());
+  }
+
+  segment.finish();
+  return segment;
+}
+
+}
@@ -21,6 +21,7 @@
 #include <cstring>
 #include <cstdlib>
 #include <string>
+#include <vector>
 
 #include <iqdb/debug.h>
 #include <iqdb/server.h>
@@ -28,6 +29,17 @@
 
 using namespace iqdb;
 
+// Parse a `--name=value` option. Returns true and sets `value` if `arg` is the option `name`.
+static bool parse_option(const char *arg, const char *name, std::string &value) {
+  const size_t len = strlen(name);
+
+  if (strncmp(arg, name, len) || arg[len] != '=')
+    return false;
+
+  value = arg + len + 1;
+  return true;
+}
+
 int main(int argc, char **argv) {
   try {
     // open_swap();
@@ -42,11 +54,62 @@ int main(int argc, char **argv) {
     }
 
     if (!strcasecmp(argv[1], "http")) {
-      const std::string host = argc >= 2 ? argv[2] : "localhost";
-      const int port = argc >= 3 ? std::stoi(argv[3]) : 8000;
-      const std::string filename = argc >= 4 ? argv[4] : "iqdb.db";
+      std::vector<std::string> args;
+      ServerOptions options;
+      std::string value;
+
+      for (int i = 2; i < argc; i++) {
+        if (parse_option(argv[i], "--threads", value))
+          options.db.query_threads = std::stoul(value);
+        else if (parse_option(argv[i], "--load-threads", value))
+          options.db.load_threads = std::stoul(value);
+        else if (parse_option(argv[i], "--signature-threads", value))
+          options.signature_threads = std::stoul(value);
+        else if (parse_option(argv[i], "--signature-queue", value))
+          options.signature_queue = std::stoul(value);
+        else if (parse_option(argv[i], "--merge-threshold", value))
+          options.merge_threshold = std::stoul(value);
+        else if (parse_option(argv[i], "--compact-threshold", value))
+          options.compact_threshold = std::stoul(value);
+        else if (parse_option(argv[i], "--cache-signatures", value))
+          options.db.cache_signatures = std::stoul(value) != 0;
+        else if (parse_option(argv[i], "--storage", value))
+          options.db.storage = value;
+        else if (parse_option(argv[i], "--log-sync", value))
+          options.db.log.sync = std::stoul(value) != 0;
+        else if (parse_option(argv[i], "--sqlite-synchronous", value))
+          options.db.sqlite.synchronous = value;
+        else if (parse_option(argv[i], "--sqlite-mmap-size", value))
+          options.db.sqlite.mmap_size = std::stoll(value);
+        else if (parse_option(argv[i], "--sqlite-cache-size", value))
+          options.db.sqlite.cache_size = std::stoll(value);
+        else if (parse_option(argv[i], "--commit-delay", value))
+          options.db.commit_delay_ms = std::stoul(value);
+        else if (parse_option(argv[i], "--commit-rows", value))
+          options.db.commit_rows = std::stoul(value);
+        else if (parse_option(argv[i], "--snapshot", value))
+          options.db.snapshot_filename = value;
+        else if (parse_option(argv[i], "--max-query-limit", value))
+          options.max_query_limit = std::stoi(value);
+        else if (parse_option(argv[i], "--max-request-bytes", value))
+          options.max_request_bytes = std::stoull(value);
+        else if (parse_option(argv[i], "--max-image-bytes", value))
+          options.decode.max_bytes = std::stoull(value);
+        else if (parse_option(argv[i], "--max-image-pixels", value))
+          options.decode.max_image_pixels = std::stoull(value);
+        else if (parse_option(argv[i], "--max-decode-pixels", value))
+          options.decode.max_decode_pixels = std::stoull(value);
+        else if (!strncmp(argv[i], "--", 2))
+          help();
+        else
+          args.push_back(argv[i]);
+      }
+
+      const std::string host = args.size() >= 1 ? args[0] : "localhost";
+      const int port = args.size() >= 2 ? std::stoi(args[1]) : 8000;
+      const std::string filename = args.size() >= 3 ? args[2] : "iqdb.db";
 
-      http_server(host, port, filename);
+      http_server(host, port, filename, options);
     } else {
       help();
     }
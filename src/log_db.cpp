@@ -0,0 +1,512 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <unordered_map>
+
+#include <iqdb/debug.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/log_db.h>
+#include <iqdb/MD5.h>
+#include <iqdb/snapshot.h>
+
+namespace iqdb {
+
+static const char log_magic[8] = { 'I', 'Q', 'D', 'B', 'L', 'O', 'G', '1' };
+static const uint32_t log_version = 1;
+static const uint32_t log_byte_order = 0x01020304;
+
+// Records written to a new log, or copied to a compacted one, per write.
+static const size_t log_write_batch = 4096;
+
+struct log_header {
+  char magic[8];        // "IQDBLOG1"
+  uint32_t version;     // log_version
+  uint32_t byte_order;  // 0x01020304, as written by the host
+  uint32_t record_size; // sizeof(log_record)
+  uint32_t reserved;
+};
+
+struct log_record {
+  enum : uint32_t { add = 1, tombstone = 2 };
+  enum : uint32_t { end_of_batch = 1 };
+
+  uint32_t type;             // add or tombstone.
+  uint32_t flags;            // end_of_batch on the last record of each batch.
+  uint32_t id;               // The internal IQDB id.
+  uint32_t post_id;          // The external (Danbooru) post ID.
+  md5_digest md5;            // Only for adds, like the rest.
+  double avglf[3];
+  int16_t sig[3][NUM_COEFS];
+  uint64_t checksum;         // Checksum of everything before it.
+
+  uint64_t computeChecksum() const {
+    static_assert(offsetof(log_record, checksum) % 8 == 0);
+    return checksum_words(checksum_seed, reinterpret_cast<const uint8_t*>(this), offsetof(log_record, checksum) / 8);
+  }
+
+  void seal() { checksum = computeChecksum(); }
+  bool valid() const { return checksum == computeChecksum() && (type == add || type == tombstone); }
+};
+
+static log_header makeHeader() {
+  log_header header = {};
+  memcpy(header.magic, log_magic, sizeof(log_magic));
+  header.version = log_version;
+  header.byte_order = log_byte_order;
+  header.record_size = sizeof(log_record);
+  return header;
+}
+
+static Image readImage(const log_record& r) {
+  Image image;
+  image.id = r.id;
+  image.post_id = r.post_id;
+  image.md5 = md5ToHex(r.md5);
+  memcpy(image.haar.avglf, r.avglf, sizeof(r.avglf));
+  memcpy(image.haar.sig, r.sig, sizeof(r.sig));
+  return image;
+}
+
+// Write all `size` bytes at `offset`, or throw.
+static void writeAll(int fd, const void* data, size_t size, uint64_t offset, const std::string& path) {
+  auto bytes = static_cast<const uint8_t*>(data);
+
+  while (size > 0) {
+    const ssize_t n = pwrite(fd, bytes, size, static_cast<off_t>(offset));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      throw database_error("Couldn't write to " + path + ": " + strerror(errno));
+
+    bytes += n;
+    size -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+}
+
+// fsync() the directory holding `path`, so that a file just created or
+// renamed there is still there after a power loss.
+static void syncDirectory(const std::string& path) {
+  const auto slash = path.rfind('/');
+  const std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+
+  const int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    throw database_error("Couldn't open " + dir + ": " + strerror(errno));
+
+  const int result = fsync(fd);
+  const int error = errno;
+  close(fd);
+
+  if (result)
+    throw database_error("Couldn't sync " + dir + ": " + strerror(error));
+}
+
+// A read-only memory map of the first `size` bytes of a log.
+class log_map {
+public:
+  log_map(int fd, uint64_t size, const std::string& path) : size_(static_cast<size_t>(size)) {
+    map_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map_ == MAP_FAILED)
+      throw fatal_error("Couldn't map " + path + ": " + strerror(errno));
+
+    madvise(map_, size_, MADV_SEQUENTIAL);
+  }
+
+  ~log_map() { munmap(map_, size_); }
+
+  log_record at(uint64_t offset) const {
+    log_record r;
+    memcpy(&r, static_cast<const uint8_t*>(map_) + offset, sizeof(r));
+    return r;
+  }
+
+private:
+  void* map_;
+  size_t size_;
+};
+
+LogDB::LogDB(const std::string& path, const LogOptions& options) : path_(path), options_(options) {
+  fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    throw fatal_error("Couldn't open log " + path + ": " + strerror(errno));
+
+  // The destructor doesn't run if the constructor throws.
+  try {
+    replay();
+  } catch (...) {
+    close(fd_);
+    throw;
+  }
+
+  compact_thread_ = std::thread([this] { compactLoop(); });
+
+  std::lock_guard lock(log_mutex_);
+  maybeCompact();
+}
+
+LogDB::~LogDB() {
+  {
+    std::lock_guard lock(log_mutex_);
+    stopping_ = true;
+  }
+
+  compact_cv_.notify_one();
+  compact_thread_.join();
+  close(fd_);
+}
+
+void LogDB::replay() {
+  struct stat st;
+  if (fstat(fd_, &st))
+    throw fatal_error("Couldn't read log " + path_ + ": " + strerror(errno));
+
+  const auto file_size = static_cast<uint64_t>(st.st_size);
+
+  if (file_size == 0) {
+    const auto header = makeHeader();
+    writeAll(fd_, &header, sizeof(header), 0, path_);
+    if (fdatasync(fd_))
+      throw database_error("Couldn't sync " + path_ + ": " + strerror(errno));
+    syncDirectory(path_);
+
+    size_ = sizeof(header);
+    return;
+  }
+
+  log_header header;
+  if (file_size < sizeof(header) || pread(fd_, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) || memcmp(header.magic, log_magic, sizeof(log_magic)))
+    throw fatal_error(path_ + " is not an iqdb log");
+  if (header.version != log_version)
+    throw fatal_error("Log " + path_ + " has unsupported version " + std::to_string(header.version));
+  if (header.byte_order != log_byte_order || header.record_size != sizeof(log_record))
+    throw fatal_error("Log " + path_ + " was written on a machine with a different byte order or struct layout");
+
+  const log_map map(fd_, file_size, path_);
+
+  // A crash while appending can leave part of a batch at the end, but never
+  // a damaged record before the last complete batch.
+  uint64_t end = sizeof(header);
+  for (uint64_t offset = end; offset + sizeof(log_record) <= file_size; offset += sizeof(log_record)) {
+    const auto r = map.at(offset);
+    if (!r.valid())
+      break;
+
+    if (r.flags & log_record::end_of_batch)
+      end = offset + sizeof(log_record);
+  }
+
+  for (uint64_t offset = sizeof(header); offset < end; offset += sizeof(log_record)) {
+    apply(map.at(offset), offset);
+  }
+
+  if (end < file_size) {
+    WARN("Dropping {} bytes of unfinished writes from the end of {}.\n", file_size - end, path_);
+
+    if (ftruncate(fd_, static_cast<off_t>(end)))
+      throw fatal_error("Couldn't truncate " + path_ + ": " + strerror(errno));
+  }
+
+  size_ = end;
+  refreshMaxIds();
+}
+
+bool LogDB::apply(const log_record& r, uint64_t offset) {
+  if (r.type == log_record::add) {
+    if (r.id >= offsets_.size()) {
+      offsets_.resize(r.id + 1);
+      post_ids_.resize(r.id + 1);
+    }
+
+    if (!offsets_[r.id])
+      image_count_++;
+
+    offsets_[r.id] = offset;
+    post_ids_[r.id] = r.post_id;
+    max_post_id_ = std::max(max_post_id_.load(), r.post_id);
+    max_id_ = std::max(max_id_.load(), r.id);
+    return false;
+  }
+
+  if (!isLive(r.id))
+    return false;
+
+  const bool removed_max = post_ids_[r.id] == max_post_id_ || r.id == max_id_;
+  offsets_[r.id] = 0;
+  post_ids_[r.id] = 0;
+  image_count_--;
+
+  return removed_max;
+}
+
+// This scans every id, but only runs when the newest post or image is
+// removed.
+void LogDB::refreshMaxIds() {
+  postId max_post_id = 0;
+  iqdbId max_id = 0;
+
+  for (size_t id = 0; id < offsets_.size(); id++) {
+    if (offsets_[id]) {
+      max_post_id = std::max(max_post_id, post_ids_[id]);
+      max_id = static_cast<iqdbId>(id);
+    }
+  }
+
+  max_post_id_ = max_post_id;
+  max_id_ = max_id;
+}
+
+std::optional<Image> LogDB::getImageById(iqdbId id) {
+  std::lock_guard lock(log_mutex_);
+
+  if (!isLive(id)) {
+    DEBUG("Couldn't find image #{} in log.\n", id);
+    return std::nullopt;
+  }
+
+  log_record r;
+  if (pread(fd_, &r, sizeof(r), static_cast<off_t>(offsets_[id])) != static_cast<ssize_t>(sizeof(r)))
+    throw database_error("Couldn't read " + path_ + ": " + strerror(errno));
+
+  return readImage(r);
+}
+
+void LogDB::applyWrites(const std::vector<QueuedWrite>& writes) {
+  std::lock_guard lock(log_mutex_);
+  std::vector<log_record> batch;
+  std::unordered_map<iqdbId, bool> live; // Ids added or removed earlier in this batch.
+  std::string conflicts;
+  size_t conflict_count = 0;
+
+  batch.reserve(writes.size());
+
+  for (const auto& write : writes) {
+    const auto it = live.find(write.id);
+    const bool is_live = it != live.end() ? it->second : isLive(write.id);
+
+    log_record r = {};
+    r.id = write.id;
+    r.post_id = write.post_id;
+
+    if (write.type == QueuedWrite::remove) {
+      if (!is_live)
+        continue;
+
+      r.type = log_record::tombstone;
+    } else {
+      const auto digest = md5FromHex(write.md5);
+
+      if (is_live || !digest) {
+        conflicts += fmt::format("{}post #{} (id {}, md5 {})", conflict_count++ ? ", " : "", write.post_id, write.id, write.md5);
+        continue;
+      }
+
+      r.type = log_record::add;
+      r.md5 = *digest;
+      memcpy(r.avglf, write.signature.avglf, sizeof(r.avglf));
+      memcpy(r.sig, write.signature.sig, sizeof(r.sig));
+    }
+
+    live[write.id] = r.type == log_record::add;
+    batch.push_back(r);
+  }
+
+  if (conflict_count)
+    throw store_conflict(fmt::format("{} of {} writes to {} have an id already in it or an invalid md5: {}", conflict_count, writes.size(), path_, conflicts));
+
+  if (batch.empty())
+    return;
+
+  batch.back().flags = log_record::end_of_batch;
+  for (auto& r : batch)
+    r.seal();
+
+  // A failed batch is overwritten by the next one, but cut it off anyway, in
+  // case all of it made it to the file.
+  try {
+    writeAll(fd_, batch.data(), batch.size() * sizeof(log_record), size_, path_);
+
+    if (options_.sync && fdatasync(fd_))
+      throw database_error("Couldn't sync " + path_ + ": " + strerror(errno));
+  } catch (...) {
+    if (ftruncate(fd_, static_cast<off_t>(size_)))
+      WARN("Couldn't truncate {}: {}.\n", path_, strerror(errno));
+    throw;
+  }
+
+  bool removed_max = false;
+  for (const auto& r : batch) {
+    removed_max |= apply(r, size_);
+    size_ += sizeof(log_record);
+  }
+
+  if (removed_max)
+    refreshMaxIds();
+
+  maybeCompact();
+}
+
+void LogDB::eachImage(std::function<void (const Image&)> func) {
+  std::lock_guard lock(log_mutex_);
+  const log_map map(fd_, size_, path_);
+
+  for (size_t id = 0; id < offsets_.size(); id++) {
+    if (offsets_[id])
+      func(readImage(map.at(offsets_[id])));
+  }
+}
+
+void LogDB::maybeCompact() {
+  const uint64_t records = (size_ - sizeof(log_header)) / sizeof(log_record);
+  const uint64_t live = static_cast<uint64_t>(image_count_.load());
+  const uint64_t dead = records - live;
+
+  if (compact_requested_ || dead < options_.compact_min_records || dead < live)
+    return;
+
+  compact_requested_ = true;
+  compact_cv_.notify_one();
+}
+
+void LogDB::compactLoop() {
+  std::unique_lock lock(log_mutex_);
+
+  while (true) {
+    compact_cv_.wait(lock, [&] { return compact_requested_ || stopping_; });
+    if (stopping_)
+      return;
+
+    lock.unlock();
+
+    try {
+      compact();
+    } catch (const std::exception& e) {
+      ERROR("Couldn't compact {}: {}.\n", path_, e.what());
+    }
+
+    lock.lock();
+    compact_requested_ = false;
+  }
+}
+
+// The live records are copied without holding log_mutex_, from the log as it
+// was when the compaction started: records are only ever appended past that
+// point. Then, with the lock held, the batches written since are copied as
+// they are, and the new log replaces the old one.
+void LogDB::compact() {
+  std::lock_guard compact_lock(compact_mutex_);
+  const std::string tmp_path = path_ + ".tmp";
+  std::vector<uint64_t> offsets;
+  uint64_t start_size;
+
+  {
+    std::lock_guard lock(log_mutex_);
+    offsets = offsets_;
+    start_size = size_;
+  }
+
+  const int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    throw database_error("Couldn't create " + tmp_path + ": " + strerror(errno));
+
+  uint64_t size = 0;
+  std::vector<log_record> buffer;
+  buffer.reserve(log_write_batch);
+
+  const auto write_buffer = [&] {
+    writeAll(fd, buffer.data(), buffer.size() * sizeof(log_record), size, tmp_path);
+    size += buffer.size() * sizeof(log_record);
+    buffer.clear();
+  };
+
+  try {
+    const auto header = makeHeader();
+    writeAll(fd, &header, sizeof(header), 0, tmp_path);
+    size = sizeof(header);
+
+    const log_map map(fd_, start_size, path_);
+
+    // Each image is copied as a batch of its own, in id order.
+    for (size_t id = 0; id < offsets.size() && !stopping_; id++) {
+      if (!offsets[id])
+        continue;
+
+      auto r = map.at(offsets[id]);
+      r.flags = log_record::end_of_batch;
+      r.seal();
+
+      offsets[id] = size + buffer.size() * sizeof(log_record);
+      buffer.push_back(r);
+
+      if (buffer.size() == log_write_batch)
+        write_buffer();
+    }
+
+    write_buffer();
+  } catch (...) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw;
+  }
+
+  if (stopping_) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    return;
+  }
+
+  std::lock_guard lock(log_mutex_);
+  const uint64_t old_size = size_;
+  const uint64_t appended_at = size;
+
+  try {
+    const log_map map(fd_, size_, path_);
+
+    for (uint64_t offset = start_size; offset < size_; offset += sizeof(log_record)) {
+      buffer.push_back(map.at(offset));
+
+      if (buffer.size() == log_write_batch)
+        write_buffer();
+    }
+
+    write_buffer();
+
+    if (fdatasync(fd))
+      throw database_error("Couldn't sync " + tmp_path + ": " + strerror(errno));
+    if (rename(tmp_path.c_str(), path_.c_str()))
+      throw database_error("Couldn't rename " + tmp_path + " to " + path_ + ": " + strerror(errno));
+  } catch (...) {
+    close(fd);
+    unlink(tmp_path.c_str());
+    throw;
+  }
+
+  // Images added since the copy started moved along with their batches.
+  // The rest are where the copy put them, unless they've been removed.
+  offsets.resize(offsets_.size());
+  for (size_t id = 0; id < offsets_.size(); id++) {
+    if (offsets_[id] >= start_size)
+      offsets[id] = appended_at + (offsets_[id] - start_size);
+    else if (!offsets_[id])
+      offsets[id] = 0;
+  }
+
+  close(fd_);
+  fd_ = fd;
+  size_ = size;
+  offsets_ = std::move(offsets);
+
+  INFO("Compacted {} from {} to {} bytes.\n", path_, old_size, size_);
+
+  // Without this, a power loss could bring back the old log, and lose every
+  // batch written to the new one.
+  syncDirectory(path_);
+}
+
+}
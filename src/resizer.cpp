@@ -1,6 +1,6 @@
 /***************************************************************************\
-    resizer.cpp - Image resizer using libgd, using pre-scaled images
-		  from libjpeg/libpng to be faster and use less memory.
+    resizer.cpp - Image resizer using libgd, using images pre-scaled
+		  by their decoders to be faster and use less memory.
 
     Copyright (C) 2008 piespy@gmail.com
 
@@ -21,55 +21,39 @@
 
 #include <gd.h>
 #include <memory>
+#include <string>
 
 #include <iqdb/debug.h>
+#include <iqdb/decoder.h>
 #include <iqdb/imgdb.h>
 #include <iqdb/resizer.h>
 
 namespace iqdb {
 
-enum image_types { IMG_UNKNOWN, IMG_JPEG, IMG_PNG, IMG_GIF, IMG_BMP };
-
-image_types get_image_info(const unsigned char *data, size_t length) {
-  if (length >= 3 && memcmp(data, "\xff\xd8\xff", 3) == 0) {
-    return IMG_JPEG;
-  } else if (length >= 4 && memcmp(data, "\x89\x50\x4e\x47", 4) == 0) {
-    return IMG_PNG;
-  } else if (length >= 3 && memcmp(data, "\x47\x49\x46", 3) == 0) {
-    return IMG_GIF;
-  } else if (length >= 2 && memcmp(data, "\x42\x4d", 2) == 0) {
-    return IMG_BMP;
-  } else {
-    return IMG_UNKNOWN;
-  }
-}
-
-RawImage get_raw_image(image_types type, size_t len, const unsigned char *data)
-{
-  switch (type)
-  {
-  case IMG_JPEG:
-    return RawImage(gdImageCreateFromJpegPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
-  case IMG_PNG:
-    return RawImage(gdImageCreateFromPngPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
-  case IMG_GIF:
-    return RawImage(gdImageCreateFromGifPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
-  case IMG_BMP:
-    return RawImage(gdImageCreateFromBmpPtr((int)len, const_cast<unsigned char *>(data)), &gdImageDestroy);
+RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y, const decode_limits& limits) {
+  if (len > limits.max_bytes)
+    throw image_error(fmt::format("Image file is too large ({} bytes, the limit is {}).", len, limits.max_bytes));
   
-  default:
+  const image_decoder *decoder = find_decoder(data, len);
+  if (!decoder)
     throw image_error("Unsupported image format.");
-  }
-}
-
-RawImage resize_image_data(const unsigned char *data, size_t len, unsigned int thu_x, unsigned int thu_y) {
-  auto type = get_image_info(data, len);
+  if (!decoder->decode)
+    throw image_error(std::string("Unsupported image format (iqdb was built without ") + decoder->name + " support).");
+  
+  // Check the image's size before anything is allocated for it.
+  image_info info;
+  if (!decoder->probe(data, len, thu_x, thu_y, info))
+    throw image_error("Could not read image.");
+  if ((uint64_t)info.width * info.height > limits.max_image_pixels)
+    throw image_error(fmt::format("Image is too large ({} x {}, the limit is {} pixels).", info.width, info.height, limits.max_image_pixels));
+  if (info.peak_pixels > limits.max_decode_pixels)
+    throw image_error(fmt::format("Image is too large to decode ({} x {} {} needs {} pixels in memory, the limit is {}).", info.width, info.height, decoder->name, info.peak_pixels, limits.max_decode_pixels));
   
   RawImage thu(gdImageCreateTrueColor(thu_x, thu_y), &gdImageDestroy);
   if (!thu)
     throw image_error("Out of memory.");
   
-  RawImage img = get_raw_image(type, len, data);
+  RawImage img = decoder->decode(data, len, thu_x, thu_y, limits);
   if (!img)
     throw image_error("Could not read image.");
   
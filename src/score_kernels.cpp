@@ -0,0 +1,100 @@
+#include <cmath>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <iqdb/imglib.h>
+#include <iqdb/score_kernels.h>
+
+namespace iqdb {
+
+using luminance_kernel = void (*)(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t begin, size_t end);
+
+static void luminance_scores_scalar(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t begin, size_t end) {
+  for (size_t i = begin; i < end; i++) {
+    Score s = 0;
+
+    for (int c = 0; c < num_colors; c++) {
+      s += weights[0][c] * std::abs(avgl[c][i] - query[c]);
+    }
+
+    out[i] = s;
+  }
+}
+
+#if defined(__x86_64__)
+
+// The vector kernels do the same operations in the same order as the scalar
+// kernel (no FMA), so every lane rounds exactly like the scalar code would.
+// |x| is computed by clearing the sign bit.
+
+__attribute__((target("avx2")))
+static void luminance_scores_avx2(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t begin, size_t end) {
+  const __m256 sign = _mm256_set1_ps(-0.0f);
+  __m256 w[3], q[3];
+
+  for (int c = 0; c < num_colors; c++) {
+    w[c] = _mm256_set1_ps(weights[0][c]);
+    q[c] = _mm256_set1_ps(query[c]);
+  }
+
+  size_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    __m256 s = _mm256_setzero_ps();
+
+    for (int c = 0; c < num_colors; c++) {
+      const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(avgl[c] + i), q[c]);
+      s = _mm256_add_ps(s, _mm256_mul_ps(w[c], _mm256_andnot_ps(sign, d)));
+    }
+
+    _mm256_storeu_ps(out + i, s);
+  }
+
+  luminance_scores_scalar(avgl, num_colors, query, out, i, end);
+}
+
+static void luminance_scores_sse2(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t begin, size_t end) {
+  const __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 w[3], q[3];
+
+  for (int c = 0; c < num_colors; c++) {
+    w[c] = _mm_set1_ps(weights[0][c]);
+    q[c] = _mm_set1_ps(query[c]);
+  }
+
+  size_t i = begin;
+  for (; i + 4 <= end; i += 4) {
+    __m128 s = _mm_setzero_ps();
+
+    for (int c = 0; c < num_colors; c++) {
+      const __m128 d = _mm_sub_ps(_mm_loadu_ps(avgl[c] + i), q[c]);
+      s = _mm_add_ps(s, _mm_mul_ps(w[c], _mm_andnot_ps(sign, d)));
+    }
+
+    _mm_storeu_ps(out + i, s);
+  }
+
+  luminance_scores_scalar(avgl, num_colors, query, out, i, end);
+}
+
+#endif
+
+// Pick the best kernel for this CPU. SSE2 is always available on x86-64.
+static luminance_kernel select_luminance_kernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2"))
+    return luminance_scores_avx2;
+
+  return luminance_scores_sse2;
+#else
+  return luminance_scores_scalar;
+#endif
+}
+
+void luminance_scores(const Score* const avgl[3], int num_colors, const Score query[3], Score* out, size_t n) {
+  static const luminance_kernel kernel = select_luminance_kernel();
+  kernel(avgl, num_colors, query, out, 0, n);
+}
+
+}
@@ -19,21 +19,28 @@
 \**************************************************************************/
 
 #include <csignal>
+#include <cmath>
 #include <cstddef>
 #include <cstring>
 #include <string>
 #include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <optional>
+#include <string_view>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <regex>
+#include <thread>
 
+#include <iqdb/buffer_pool.h>
 #include <iqdb/debug.h>
 #include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
 #include <iqdb/haar_signature.h>
 #include <iqdb/types.h>
 #include <iqdb/MD5.h>
+#include <iqdb/server.h>
 
 #include <httplib.h>
 #include <nlohmann/json.hpp>
@@ -46,6 +53,28 @@ namespace iqdb {
 
 static Server server;
 
+// The fields of a multipart/form-data request body, in the order they were sent.
+struct upload_form {
+  struct field {
+    std::string name;
+    std::string filename;
+    buffer_pool::buffer content;
+  };
+  
+  std::vector<field> fields;
+  bool too_large = false; // Whether reading stopped because a field was too large.
+  
+  // The first field called `name`, or null if there isn't one.
+  const field* find(std::string_view name) const {
+    for (const auto& part : fields) {
+      if (part.name == name)
+        return &part;
+    }
+    
+    return nullptr;
+  }
+};
+
 static void signal_handler(int signal, siginfo_t* info, void* ucontext) {
   INFO("Received signal {} ({})\n", signal, strsignal(signal));
 
@@ -72,19 +101,126 @@ void install_signal_handlers() {
   sigaction(SIGSEGV, &action, NULL);
 }
 
-void http_server(const std::string host, const int port, const std::string database_filename) {
+void http_server(const std::string host, const int port, const std::string database_filename, const ServerOptions& options) {
   INFO("Starting server...\n");
   
-  std::shared_mutex mutex_;
-  auto memory_db = std::make_unique<IQDB>(database_filename);
+  // Serializes the changes the handlers make to the database, since some of
+  // them read it before they write (e.g. to pick the next post id). Hashing
+  // and decoding uploads happens before it's taken, and queries never take
+  // it: IQDB lets them run alongside writes.
+  std::mutex write_mutex_;
+  auto memory_db = std::make_unique<IQDB>(database_filename, options.db);
+  
+  // Hashes and decodes uploaded images, for every endpoint that takes them,
+  // so that a flood of large uploads can only keep this many threads busy.
+  // Once too many images are waiting, requests are turned away with a 503.
+  ThreadPool signature_pool(options.signature_threads ? options.signature_threads : std::max<size_t>(1, std::thread::hardware_concurrency()), options.signature_queue);
+  
+  // Turn a request away because the signature pool's queue is full. Clients
+  // are asked to retry once the images ahead of them should be done.
+  auto reject_busy = [&](auto &response) {
+    const auto stats = signature_pool.getStats();
+    const double average_run = stats.completed ? stats.run_seconds / (double)stats.completed : 0;
+    const auto retry_after = std::max<long>(1, std::lround(std::ceil(average_run * (double)stats.queued / (double)signature_pool.size())));
+    
+    json data = {
+      { "error", "Too many images are waiting to be processed, try again later." }
+    };
+    
+    response.status = 503;
+    response.set_header("Retry-After", std::to_string(retry_after));
+    response.set_content(data.dump(4), "application/json");
+    DEBUG("Rejected request: {} images are waiting to be processed.\n", stats.queued);
+  };
+  
+  // Turn a batch away if it has more images than the signature pool's queue
+  // can ever hold. Retrying wouldn't help, so it's a 413, not a 503.
+  auto reject_oversized_batch = [&](auto &response, size_t count) {
+    if (!signature_pool.maxQueue() || count <= signature_pool.maxQueue())
+      return false;
+    
+    json data = {
+      { "error", fmt::format("Too many images in one request ({}, the limit is {}).", count, signature_pool.maxQueue()) }
+    };
+    
+    response.status = 413;
+    response.set_content(data.dump(4), "application/json");
+    DEBUG("Rejected request: {} images is more than the queue holds.\n", count);
+    return true;
+  };
+  
+  // Uploaded files are read from the connection straight into these
+  // buffers, instead of into the request body and then into a copy for each
+  // multipart field, and handed to the decoder without another copy.
+  buffer_pool upload_buffers(64 * 1024 * 1024);
+  
+  // Read the fields of a multipart/form-data request as they arrive. Fields
+  // larger than the largest image allowed aren't read: the request fails
+  // with a 413, and nothing is returned. Other request bodies have no fields.
+  auto read_form = [&](const auto &request, auto &response, const auto &content_reader) -> std::optional<upload_form> {
+    upload_form form;
+    bool ok;
+    
+    if (request.is_multipart_form_data()) {
+      ok = content_reader(
+        [&](const httplib::MultipartFormData &field) {
+          form.fields.push_back({ field.name, field.filename, upload_buffers.acquire() });
+          return true;
+        },
+        [&](const char *data, size_t len) {
+          auto& content = form.fields.back().content.data();
+          if (content.size() + len > options.decode.max_bytes) {
+            form.too_large = true;
+            return false;
+          }
+          
+          content.append(data, len);
+          return true;
+        });
+    } else {
+      ok = content_reader([](const char *data, size_t len) { return true; });
+    }
+    
+    if (ok)
+      return form;
+    
+    json data = {
+      { "error", form.too_large ? fmt::format("Image file is too large (the limit is {} bytes).", options.decode.max_bytes) : "Couldn't read the request body." }
+    };
+    
+    response.status = form.too_large ? 413 : 400;
+    response.set_content(data.dump(4), "application/json");
+    DEBUG("Upload Error. {}\n", data["error"].template get<std::string>());
+    return std::nullopt;
+  };
   
   install_signal_handlers();
   
+  // Merge newly added ids into the frozen bucket segment, and drop removed
+  // images from it, in the background. Neither queries nor writes wait for
+  // the merge; writes that land while it runs are carried over into the new
+  // delta segment and tombstones when it's installed.
+  std::mutex maintenance_mutex;
+  std::condition_variable maintenance_cv;
+  bool stopping = false;
+  
+  std::thread maintenance_thread([&] {
+    std::unique_lock maintenance_lock(maintenance_mutex);
+    
+    while (!maintenance_cv.wait_for(maintenance_lock, std::chrono::seconds(1), [&] { return stopping; })) {
+      if (memory_db->getPendingBucketIds() < options.merge_threshold && memory_db->getPendingRemovals() < options.compact_threshold)
+        continue;
+      
+      if (memory_db->installBuckets(memory_db->mergeBuckets()))
+        DEBUG("Merged and compacted buckets.\n");
+      else
+        DEBUG("Bucket merge raced with another merge; retrying later.\n");
+    }
+  });
+  
   // Adding Image
   // requires id, add or replace img if id exists
-  server.Post("/images/(\\d+)", [&](const auto &request, auto &response) {
-    std::unique_lock lock(mutex_);
-    
+  server.Post("/images/(\\d+)", [&](const auto &request, auto &response, const auto &content_reader) {
     const postId post_id = std::stoi(request.matches[1]);
     std::string md5 = "";
     bool invalid_id = false;
@@ -92,8 +228,13 @@ void http_server(const std::string host, const int port, const std::string datab
     bool invalid_md5 = false;
     json data;
     
+    const auto form = read_form(request, response, content_reader);
+    if (!form)
+      return;
+    
     // checking
-    if (!request.has_file("file"))
+    const auto* file = form->find("file");
+    if (!file)
       no_file = true;
     
     if (post_id <= 0)
@@ -101,23 +242,32 @@ void http_server(const std::string host, const int port, const std::string datab
     
     if (!invalid_id && !no_file)
     {
-      const auto& file = request.get_file_value("file");
-      
       // handle MD5 param
       if (request.has_param("md5")) {
         md5 = request.get_param_value("md5");
         if (md5.size() != 32 || !std::all_of(md5.begin(), md5.end(), ::isxdigit))
           invalid_md5 = true;
       } else {
-        md5 = getMD5(file.content);
+        md5 = getMD5(file->content.view());
       }
       
       // add image & create response data
       try {
         if (invalid_md5)
           throw image_error("Invalid MD5 parameter, MD5 must be 32-digit hex string.");
-        const auto signature = HaarSignature::from_file_content(file.content);
-        memory_db->addImage(post_id, md5, signature); // replace_img = true
+        auto task = signature_pool.trySubmit([&] { return HaarSignature::from_file_content(file->content.view(), options.decode); });
+        if (!task) {
+          reject_busy(response);
+          return;
+        }
+        
+        const auto signature = task->get();
+        
+        {
+          std::lock_guard lock(write_mutex_);
+          memory_db->addImage(post_id, md5, signature); // replace_img = true
+        }
+        
         data = {
           { "post_id", post_id },
           { "md5", md5 },
@@ -158,38 +308,51 @@ void http_server(const std::string host, const int port, const std::string datab
   });
   
   // add new img with last post id
-  server.Post("/images", [&](const auto &request, auto &response) {
-    std::unique_lock lock(mutex_);
-    
-    const postId post_id = memory_db->getLastPostId()+1;
+  server.Post("/images", [&](const auto &request, auto &response, const auto &content_reader) {
+    postId post_id = memory_db->getLastPostId()+1; // Re-read under the write lock before adding.
     std::string md5 = "";
     bool no_file = false;
     bool invalid_md5 = false;
     json data;
     
+    const auto form = read_form(request, response, content_reader);
+    if (!form)
+      return;
+    
     // checking
-    if (!request.has_file("file"))
+    const auto* file = form->find("file");
+    if (!file)
       no_file = true;
     
     if (!no_file)
     {
-      const auto& file = request.get_file_value("file");
-      
       // handle MD5 param
       if (request.has_param("md5")) {
         md5 = request.get_param_value("md5");
         if (md5.size() != 32 || !std::all_of(md5.begin(), md5.end(), ::isxdigit))
           invalid_md5 = true;
       } else {
-        md5 = getMD5(file.content);
+        md5 = getMD5(file->content.view());
       }
       
       // add image & create response data
       try {
         if (invalid_md5)
           throw image_error("Invalid MD5 parameter, MD5 must be 32-digit hex string.");
-        const auto signature = HaarSignature::from_file_content(file.content);
-        memory_db->addImage(post_id, md5, signature, false); // replace_img = false
+        auto task = signature_pool.trySubmit([&] { return HaarSignature::from_file_content(file->content.view(), options.decode); });
+        if (!task) {
+          reject_busy(response);
+          return;
+        }
+        
+        const auto signature = task->get();
+        
+        {
+          std::lock_guard lock(write_mutex_);
+          post_id = memory_db->getLastPostId()+1;
+          memory_db->addImage(post_id, md5, signature, false); // replace_img = false
+        }
+        
         data = {
           { "post_id", post_id },
           { "md5", md5 },
@@ -221,9 +384,123 @@ void http_server(const std::string host, const int port, const std::string datab
     response.set_content(data.dump(4), "application/json");
   });
   
+  // Add or replace many images at once. Each image is given as a `post_id`
+  // field and a `file` field, plus an optional `md5` field, matched up by
+  // their order in the request. The images are hashed and decoded on the
+  // signature pool, then added in one database transaction.
+  server.Post("/images/batch", [&](const auto &request, auto &response, const auto &content_reader) {
+    struct batch_item {
+      NewImage image;
+      std::string error;
+    };
+    
+    std::vector<const upload_form::field*> post_ids, files, md5s;
+    json data = json::array();
+    
+    const auto form = read_form(request, response, content_reader);
+    if (!form)
+      return;
+    
+    for (const auto& part : form->fields) {
+      if (part.name == "post_id")
+        post_ids.push_back(&part);
+      else if (part.name == "file")
+        files.push_back(&part);
+      else if (part.name == "md5")
+        md5s.push_back(&part);
+    }
+    
+    if (files.empty() || post_ids.size() != files.size() || (!md5s.empty() && md5s.size() != files.size())) {
+      data = {
+        { "error", "`POST /images/batch` requires a `post_id` and a `file` param for each image, and an `md5` param for each image or none." }
+      };
+      response.status = 400;
+      DEBUG("Adding Error. `POST /images/batch` requires a `post_id` and a `file` param for each image.\n");
+      response.set_content(data.dump(4), "application/json");
+      return;
+    }
+    
+    if (reject_oversized_batch(response, files.size()))
+      return;
+    
+    auto tasks = signature_pool.trySubmit(files.size(), [&](size_t i) {
+      batch_item item;
+      auto& image = item.image;
+      const auto post_id = std::string(post_ids[i]->content.view());
+      
+      try {
+        if (post_id.empty() || post_id.size() > 9 || !std::all_of(post_id.begin(), post_id.end(), ::isdigit) || std::stoi(post_id) <= 0)
+          throw image_error("Input post_id must greater than 0.");
+        image.post_id = std::stoi(post_id);
+        
+        image.md5 = md5s.empty() ? "" : std::string(md5s[i]->content.view());
+        if (image.md5.empty())
+          image.md5 = getMD5(files[i]->content.view());
+        else if (image.md5.size() != 32 || !std::all_of(image.md5.begin(), image.md5.end(), ::isxdigit))
+          throw image_error("Invalid MD5 parameter, MD5 must be 32-digit hex string.");
+        
+        image.signature = HaarSignature::from_file_content(files[i]->content.view(), options.decode);
+      } catch (const image_error& e) {
+        item.error = e.what();
+      }
+      
+      return item;
+    });
+    
+    if (!tasks) {
+      reject_busy(response);
+      return;
+    }
+    
+    // Wait for every task before calling get(), so that no task outlives the
+    // request it reads from if one of them threw.
+    for (auto& task : *tasks)
+      task.wait();
+    
+    std::vector<batch_item> items;
+    std::vector<NewImage> images;
+    std::vector<size_t> positions;
+    
+    for (auto& task : *tasks) {
+      items.push_back(task.get());
+      
+      if (items.back().error.empty()) {
+        images.push_back(items.back().image);
+        positions.push_back(items.size() - 1);
+      }
+    }
+    
+    if (!images.empty()) {
+      std::lock_guard lock(write_mutex_);
+      const auto errors = memory_db->addImages(images);
+      
+      for (size_t i = 0; i < errors.size(); i++)
+        items[positions[i]].error = errors[i];
+    }
+    
+    for (const auto& item : items) {
+      if (item.error.empty()) {
+        data.push_back({
+          { "post_id", item.image.post_id },
+          { "md5", item.image.md5 },
+          { "hash", item.image.signature.to_string() }
+        });
+      } else {
+        data.push_back({
+          { "error", item.error },
+          { "post_id", item.image.post_id },
+          { "md5", item.image.md5 }
+        });
+        DEBUG("Adding Error. post_id: {}, md5: {}, error: {}\n", item.image.post_id, item.image.md5, item.error);
+      }
+    }
+    
+    response.set_content(data.dump(4), "application/json");
+  });
+  
   // Removing images
   server.Delete("/images/([0-9a-fA-F]{0,32})", [&](const auto &request, auto &response) {
-    std::unique_lock lock(mutex_);
+    std::lock_guard lock(write_mutex_);
     
     postId post_id = 0;
     std::string md5 = "";
@@ -281,27 +558,201 @@ void http_server(const std::string host, const int port, const std::string datab
     response.set_content(data.dump(4), "application/json");
   });
   
-  // Searching for images
-  server.Post("/query/([0-9a-fA-Fiqdb_file]+)", [&](const auto &request, auto &response) {
-    std::shared_lock lock(mutex_);
+  // Read the `limit` param of a query. A limit that isn't a number, or is
+  // out of range, gets a 400 and returns nothing.
+  auto parse_limit = [&](const auto &request, auto &response) -> std::optional<int> {
+    if (!request.has_param("limit"))
+      return 10;
+    
+    const auto param = request.get_param_value("limit");
+    if (!param.empty() && param.size() <= 9 && std::all_of(param.begin(), param.end(), ::isdigit)) {
+      const int limit = std::stoi(param);
+      if (limit <= options.max_query_limit)
+        return limit;
+    }
+    
+    json data = {
+      { "error", fmt::format("Invalid limit '{}'; it must be a number from 0 to {}.", param, options.max_query_limit) }
+    };
     
-    int limit = 10;
+    response.status = 400;
+    response.set_content(data.dump(4), "application/json");
+    DEBUG("Querying Error. Invalid limit '{}'.\n", param);
+    return std::nullopt;
+  };
+  
+  // Format the matches of a query as json, dropping duplicates and keeping
+  // at most `limit` of them.
+  auto matches_to_json = [&](const sim_vector& matches, int limit) {
+    json data = json::array();
+    
+    // rm duplicate in matches
+    sim_vector unique;
+    unique.reserve(matches.size());
+    for (const auto& m : matches)
+    {
+      if (std::find(unique.begin(), unique.end(), m) == unique.end())
+        unique.emplace_back(m);
+    }
+    
+    for (const auto &match : unique) {
+      if (limit == 0)
+        break;
+      
+      // Skip images removed since the query ran.
+      const auto image = memory_db->getImage(match.id);
+      if (!image)
+        continue;
+      
+      data += {
+        { "post_id", match.id },
+        { "md5", image->md5 },
+        { "score", match.score },
+        { "hash", image->haar.to_string() },
+        { "signature", {
+          { "avglf", image->haar.avglf },
+          { "sig", image->haar.sig },
+        }}
+      };
+      
+      limit--;
+    }
+    
+    return data;
+  };
+  
+  // Search for many images at once. Each `query` field is either an image
+  // file, a haar hash or an md5 hash. All of them are scored together in a
+  // single pass over the database.
+  server.Post("/query/batch", [&](const auto &request, auto &response, const auto &content_reader) {
+    struct query_item {
+      HaarSignature signature;
+      std::string error;
+    };
+    
+    json data = json::array();
+    
+    const auto form = read_form(request, response, content_reader);
+    if (!form)
+      return;
+    
+    const auto limit_param = parse_limit(request, response);
+    if (!limit_param)
+      return;
+    const int limit = *limit_param;
+    
+    std::vector<const upload_form::field*> queries;
+    for (const auto& part : form->fields) {
+      if (part.name == "query")
+        queries.push_back(&part);
+    }
+    
+    if (queries.empty()) {
+      data = {
+        { "error", "`POST /query/batch` requires at least one `query` param." }
+      };
+      response.status = 400;
+      DEBUG("Querying Error. `POST /query/batch` requires at least one `query` param.\n");
+      response.set_content(data.dump(4), "application/json");
+      return;
+    }
+    
+    if (reject_oversized_batch(response, queries.size()))
+      return;
+    
+    auto tasks = signature_pool.trySubmit(queries.size(), [&](size_t i) {
+      query_item item;
+      const auto& part = *queries[i];
+      const auto param = part.content.view();
+      
+      try {
+        // input image file
+        if (!part.filename.empty())
+          item.signature = HaarSignature::from_file_content(param, options.decode);
+        // input image haar hash
+        else if (param.size() == 533 && param.substr(0, 5) == "iqdb_" && std::all_of(param.begin()+6, param.end(), ::isxdigit))
+          item.signature = HaarSignature::from_hash(std::string(param));
+        // input image md5 hash
+        else if (param.size() == 32 && std::all_of(param.begin(), param.end(), ::isxdigit)) {
+          const auto img = memory_db->getImageByMD5(std::string(param));
+          if (img == std::nullopt)
+            throw image_error("Couldn't find image from supplied hash.");
+          item.signature = img->haar;
+        }
+        else
+          throw image_error("Invalid query, you should supply an image file, md5 hash string (32-digit), or haar hash string (start with `iqdb_`, 533-digit).");
+      } catch (const image_error& e) {
+        item.error = e.what();
+      }
+      
+      return item;
+    });
+    
+    if (!tasks) {
+      reject_busy(response);
+      return;
+    }
+    
+    // Wait for every task before calling get(), so that no task outlives the
+    // request it reads from if one of them threw.
+    for (auto& task : *tasks)
+      task.wait();
+    
+    std::vector<query_item> items;
+    std::vector<HaarSignature> signatures;
+    
+    for (auto& task : *tasks) {
+      items.push_back(task.get());
+      
+      if (items.back().error.empty())
+        signatures.push_back(items.back().signature);
+    }
+    
+    const auto results = memory_db->queryFromSignatures(signatures, limit);
+    
+    size_t next = 0;
+    for (const auto& item : items) {
+      if (item.error.empty()) {
+        data.push_back(matches_to_json(results[next++], limit));
+      } else {
+        data.push_back({ { "error", item.error } });
+        DEBUG("Querying Error. {}\n", item.error);
+      }
+    }
+    
+    response.set_content(data.dump(4), "application/json");
+  });
+  
+  // Searching for images
+  server.Post("/query/([0-9a-fA-Fiqdb_file]+)", [&](const auto &request, auto &response, const auto &content_reader) {
     sim_vector matches;
     json data = json::array();
     std::string tmp_param = request.matches[1];
     bool bad_request = false;
     bool couldnt_find_img = false;
     
+    const auto form = read_form(request, response, content_reader);
+    if (!form)
+      return;
+    
     // handle param
-    if (request.has_param("limit"))
-      limit = stoi(request.get_param_value("limit"));
+    const auto limit_param = parse_limit(request, response);
+    if (!limit_param)
+      return;
+    const int limit = *limit_param;
     
     // handle request url
     // input image file
-    if (tmp_param == "file" && request.has_file("file"))
+    const auto* file = form->find("file");
+    if (tmp_param == "file" && file)
     {
-      const auto &file = request.get_file_value("file");
-      matches = memory_db->queryFromBlob(file.content, limit);
+      auto task = signature_pool.trySubmit([&] { return HaarSignature::from_file_content(file->content.view(), options.decode); });
+      if (!task) {
+        reject_busy(response);
+        return;
+      }
+      
+      matches = memory_db->queryFromSignature(task->get(), limit);
     }
     // input image haar hash
     else if (tmp_param.size() == 533 && tmp_param.substr(0, 5) == "iqdb_" && std::all_of(tmp_param.begin()+6, tmp_param.end(), ::isxdigit))
@@ -318,7 +769,7 @@ void http_server(const std::string host, const int port, const std::string datab
       const auto md5 = tmp_param;
       const auto img = memory_db->getImageByMD5(md5);
       if (img != std::nullopt)
-        matches = memory_db->queryFromSignature(img->haar(), limit);
+        matches = memory_db->queryFromSignature(img->haar, limit);
       else
         couldnt_find_img = true;
     }
@@ -330,38 +781,7 @@ void http_server(const std::string host, const int port, const std::string datab
     
     if (!bad_request && !couldnt_find_img)
     {
-      // rm duplicate in matches
-      // insert non-duplicate elements into tmp
-      sim_vector tmp;
-      tmp.reserve(matches.size());
-      for (auto m : matches)
-      {
-        if (std::find(tmp.begin(), tmp.end(), m) == tmp.end())
-          tmp.emplace_back(m);
-      }
-      // overwrite matches with tmp
-      matches.assign(tmp.begin(), tmp.end());
-      
-      for (const auto &match : matches) {
-        if (limit == 0)
-          break;
-        
-        auto image = memory_db->getImage(match.id);
-        auto haar = image->haar();
-        
-        data += {
-          { "post_id", match.id },
-          { "md5", image->md5 },
-          { "score", match.score },
-          { "hash", haar.to_string() },
-          { "signature", {
-            { "avglf", haar.avglf },
-            { "sig", haar.sig },
-          }}
-        };
-        
-        limit--;
-      }
+      data = matches_to_json(matches, limit);
     }
     else if (bad_request)
     {
@@ -385,13 +805,31 @@ void http_server(const std::string host, const int port, const std::string datab
   
   // DB status
   server.Get("/status", [&](const auto &request, auto &response) {
-    std::shared_lock lock(mutex_);
-    
     const size_t count = memory_db->getImgCount();
     const postId post_id = memory_db->getLastPostId();
+    const auto arenas = memory_db->getArenaStats();
+    const auto signatures = signature_pool.getStats();
+    const size_t started = signatures.completed + signatures.running;
     json data = {
       {"image_count", count},
-      {"last_post_id", post_id}
+      {"last_post_id", post_id},
+      {"pending_writes", memory_db->getQueuedWrites()},
+      {"store_conflicts", memory_db->getStoreConflicts()},
+      {"query_arenas", {
+        {"count", arenas.arenas},
+        {"allocations", arenas.allocations},
+        {"bytes", arenas.bytes}
+      }},
+      {"signature_pool", {
+        {"threads", signature_pool.size()},
+        {"queue_length", signatures.queued},
+        {"max_queue_length", signature_pool.maxQueue()},
+        {"running", signatures.running},
+        {"completed", signatures.completed},
+        {"rejected", signatures.rejected},
+        {"average_wait_ms", started ? 1000 * signatures.wait_seconds / (double)started : 0.0},
+        {"max_wait_ms", 1000 * signatures.max_wait_seconds}
+      }}
     };
     
     response.set_content(data.dump(4), "application/json");
@@ -417,16 +855,84 @@ void http_server(const std::string host, const int port, const std::string datab
     res.status = 500;
   });
   
+  // Each image in a form is capped by read_form(), but not how many there
+  // are. Cap the whole body too, or one batch request could make the server
+  // buffer any amount of data before the signature pool can turn it away.
+  server.set_payload_max_length(options.max_request_bytes);
+  
   INFO("Listening on {}:{}.\n", host, port);
   server.listen(host.c_str(), port);
   INFO("Stopping server...\n");
+  
+  {
+    std::lock_guard maintenance_lock(maintenance_mutex);
+    stopping = true;
+  }
+  
+  maintenance_cv.notify_all();
+  maintenance_thread.join();
+  
+  // The signal handler only stops the server, since SQLite can't be called
+  // from a signal handler. Changes still queued for a group commit are
+  // committed here, once the last request has finished.
+  try {
+    memory_db->flush();
+  } catch (const base_error& e) {
+    ERROR("Couldn't commit {} queued writes: {}.\n", memory_db->getQueuedWrites(), e.what());
+  }
+  
+  try {
+    memory_db->saveSnapshot();
+  } catch (const snapshot_error& e) {
+    ERROR("{}.\n", e.what());
+  }
 }
 
 void help() {
   printf(
     "Usage: iqdb COMMAND [ARGS...]\n"
-    "  iqdb http [host] [port] [dbfile]  Run HTTP server on given host/port.\n"
-    "  iqdb help                         Show this help.\n"
+    "  iqdb http [host] [port] [dbfile] [OPTIONS...]  Run HTTP server on given host/port.\n"
+    "  iqdb help                                      Show this help.\n"
+    "\n"
+    "Options for `iqdb http`:\n"
+    "  --threads=N            Split each query into N shards scored in parallel (default: 1).\n"
+    "  --load-threads=N       Build the index on N threads at startup (default: one per CPU).\n"
+    "  --signature-threads=N  Hash uploaded images on N threads (default: one per CPU).\n"
+    "  --signature-queue=N    Turn requests away with a 503 while N uploaded images are\n"
+    "                         waiting to be hashed, or never if 0 (default: 64).\n"
+    "  --merge-threshold=N    Merge recently added bucket ids into the compact index once\n"
+    "                         N ids are pending (default: 1000000).\n"
+    "  --compact-threshold=N  Drop removed images from the index once N removals are\n"
+    "                         pending (default: 10000).\n"
+    "  --cache-signatures=0   Read the signatures of query results from dbfile, instead of\n"
+    "                         keeping every image's signature in memory.\n"
+    "  --snapshot=FILE        Save the index to FILE on shutdown, and load it from there\n"
+    "                         on startup instead of rebuilding it from dbfile.\n"
+    "  --storage=TYPE         Store dbfile as an SQLite database (sqlite), or as an\n"
+    "                         append-only log of image records (log) (default: sqlite).\n"
+    "  --log-sync=0           With --storage=log, don't sync dbfile to disk after every\n"
+    "                         commit.\n"
+    "  --sqlite-synchronous=MODE\n"
+    "                         How carefully dbfile is synced to disk: OFF, NORMAL, FULL\n"
+    "                         or EXTRA (default: NORMAL).\n"
+    "  --sqlite-mmap-size=N   Read up to N bytes of dbfile through a memory map\n"
+    "                         (default: 268435456).\n"
+    "  --sqlite-cache-size=N  Cache up to N bytes of dbfile's pages in memory\n"
+    "                         (default: 67108864).\n"
+    "  --commit-delay=MS      Commit changes to dbfile in batches, at most MS milliseconds\n"
+    "                         after they're made, instead of one at a time. Changes not yet\n"
+    "                         committed are lost if iqdb crashes (default: 0).\n"
+    "  --commit-rows=N        Commit a batch early once N changes are waiting\n"
+    "                         (default: 1000).\n"
+    "  --max-query-limit=N    Reject queries asking for more than N results\n"
+    "                         (default: 1000).\n"
+    "  --max-request-bytes=N  Reject requests larger than N bytes, such as batches of many\n"
+    "                         images (default: 268435456).\n"
+    "  --max-image-bytes=N    Reject image files larger than N bytes (default: 104857600).\n"
+    "  --max-image-pixels=N   Reject images larger than N pixels (default: 250000000).\n"
+    "  --max-decode-pixels=N  Reject images that would need more than N pixels in memory\n"
+    "                         to decode, after scaling them down while decoding\n"
+    "                         (default: 64000000).\n"
   );
   
   exit(0);
@@ -0,0 +1,160 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include <iqdb/debug.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/snapshot.h>
+
+namespace iqdb {
+
+static const char snapshot_magic[8] = { 'I', 'Q', 'D', 'B', 'S', 'N', 'A', 'P' };
+static const uint32_t snapshot_byte_order = 0x01020304;
+
+// Everything in a snapshot is padded to 8 bytes, so the checksum can work a
+// 64-bit word at a time.
+static size_t padded_size(size_t size) {
+  return (size + 7) & ~static_cast<size_t>(7);
+}
+
+uint64_t checksum_words(uint64_t hash, const uint8_t* data, size_t n_words) {
+  for (size_t i = 0; i < n_words; i++) {
+    uint64_t word;
+    memcpy(&word, data + 8 * i, sizeof(word));
+
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+
+  return hash;
+}
+
+snapshot_writer::snapshot_writer(const std::string& filename) : filename_(filename), tmp_filename_(filename + ".tmp"), checksum_(checksum_seed) {
+  file_ = fopen(tmp_filename_.c_str(), "wb");
+  if (!file_)
+    throw snapshot_error("Couldn't create snapshot " + tmp_filename_ + ": " + strerror(errno));
+
+  // Reserve space for the header; commit() fills it in.
+  snapshot_header header = {};
+  if (fwrite(&header, sizeof(header), 1, file_) != 1)
+    throw snapshot_error("Couldn't write snapshot " + tmp_filename_);
+}
+
+snapshot_writer::~snapshot_writer() {
+  // Only true if commit() was never reached.
+  if (file_) {
+    fclose(file_);
+    unlink(tmp_filename_.c_str());
+  }
+}
+
+void snapshot_writer::write_bytes(const void* data, size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  const size_t full_words = size / 8;
+  uint8_t tail[8] = {};
+
+  memcpy(tail, bytes + 8 * full_words, size % 8);
+  checksum_ = checksum_words(checksum_, bytes, full_words);
+
+  if (fwrite(bytes, 1, 8 * full_words, file_) != 8 * full_words)
+    throw snapshot_error("Couldn't write snapshot " + tmp_filename_);
+
+  if (size % 8) {
+    checksum_ = checksum_words(checksum_, tail, 1);
+
+    if (fwrite(tail, 1, sizeof(tail), file_) != sizeof(tail))
+      throw snapshot_error("Couldn't write snapshot " + tmp_filename_);
+  }
+
+  payload_size_ += padded_size(size);
+}
+
+void snapshot_writer::commit(uint64_t image_count, uint64_t max_id) {
+  snapshot_header header = {};
+  memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+  header.version = snapshot_version;
+  header.byte_order = snapshot_byte_order;
+  header.image_count = image_count;
+  header.max_id = max_id;
+  header.payload_size = payload_size_;
+  header.checksum = checksum_;
+
+  if (fseek(file_, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, file_) != 1 || fflush(file_) || fsync(fileno(file_)))
+    throw snapshot_error("Couldn't write snapshot " + tmp_filename_ + ": " + strerror(errno));
+
+  fclose(file_);
+  file_ = nullptr;
+
+  if (rename(tmp_filename_.c_str(), filename_.c_str()))
+    throw snapshot_error("Couldn't rename snapshot to " + filename_ + ": " + strerror(errno));
+}
+
+snapshot_reader::snapshot_reader(const std::string& filename) : filename_(filename) {
+  const int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0)
+    fail(strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(snapshot_header)) {
+    close(fd);
+    fail("file is too small");
+  }
+
+  map_size_ = static_cast<size_t>(st.st_size);
+  map_ = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if (map_ == MAP_FAILED) {
+    map_ = nullptr;
+    fail(strerror(errno));
+  }
+
+  madvise(map_, map_size_, MADV_SEQUENTIAL);
+
+  pos_ = static_cast<const uint8_t*>(map_) + sizeof(snapshot_header);
+  end_ = static_cast<const uint8_t*>(map_) + map_size_;
+
+  // The destructor doesn't run if the constructor throws.
+  try {
+    validate();
+  } catch (...) {
+    munmap(map_, map_size_);
+    throw;
+  }
+}
+
+void snapshot_reader::validate() const {
+  if (memcmp(header().magic, snapshot_magic, sizeof(snapshot_magic)))
+    fail("not a snapshot file");
+  if (header().version != snapshot_version)
+    fail("unsupported version " + std::to_string(header().version));
+  if (header().byte_order != snapshot_byte_order)
+    fail("written on a machine with a different byte order");
+  if (header().payload_size != remaining() || remaining() % 8)
+    fail("file is truncated");
+  if (checksum_words(checksum_seed, pos_, remaining() / 8) != header().checksum)
+    fail("checksum mismatch");
+}
+
+snapshot_reader::~snapshot_reader() {
+  if (map_)
+    munmap(map_, map_size_);
+}
+
+void snapshot_reader::read_bytes(void* data, size_t size) {
+  if (padded_size(size) > remaining())
+    fail("unexpected end of file");
+
+  memcpy(data, pos_, size);
+  pos_ += padded_size(size);
+}
+
+void snapshot_reader::fail(const std::string& reason) const {
+  throw snapshot_error("Invalid snapshot " + filename_ + ": " + reason);
+}
+
+}
@@ -1,109 +1,389 @@
-#include <fstream>
-#include <iostream>
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
 #include <optional>
+#include <string>
 #include <vector>
-#include <system_error>
 
 #include <iqdb/debug.h>
+#include <iqdb/imgdb.h>
 #include <iqdb/imglib.h>
+#include <iqdb/MD5.h>
 #include <iqdb/sqlite_db.h>
 #include <iqdb/types.h>
 
 namespace iqdb {
 
-using namespace sqlite_orm;
+// An md5 to bind to a statement: its 16 bytes as a blob if it's valid hex,
+// or else its text, so that it can't be mistaken for a digest when it's read.
+struct md5_param {
+  const std::string& md5;
+};
+
+// A statement compiled once, when the database is opened, and run many
+// times. Each run binds new parameters, steps through the rows, and resets
+// the statement, so that a statement that wasn't stepped to the end doesn't
+// hold its read transaction open.
+class sqlite_statement {
+public:
+  sqlite_statement(sqlite3* db, const char* sql) : db_(db) {
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt_, nullptr) != SQLITE_OK)
+      throw database_error(std::string("Couldn't prepare `") + sql + "`: " + sqlite3_errmsg(db));
+  }
+
+  ~sqlite_statement() { sqlite3_finalize(stmt_); }
+
+  sqlite_statement(const sqlite_statement&) = delete;
+  sqlite_statement& operator=(const sqlite_statement&) = delete;
+
+  // Bind the parameters of the next run, in order.
+  template <typename... Args>
+  sqlite_statement& bind(const Args&... args) {
+    sqlite3_reset(stmt_);
+    [[maybe_unused]] int i = 0;
+    (bindOne(++i, args), ...);
+    return *this;
+  }
+
+  // Step to the next row. Returns false once there are no more rows.
+  bool step() {
+    const int rc = sqlite3_step(stmt_);
+    if (rc == SQLITE_ROW)
+      return true;
+    if (rc == SQLITE_DONE)
+      return false;
+
+    sqlite3_reset(stmt_);
+    throw database_error(std::string("SQLite error: ") + sqlite3_errmsg(db_));
+  }
+
+  // Run a statement that returns no rows.
+  void run() {
+    step();
+    reset();
+  }
+
+  void reset() { sqlite3_reset(stmt_); }
+
+  bool isBlob(int col) const { return sqlite3_column_type(stmt_, col) == SQLITE_BLOB; }
+
+  int64_t integer(int col) const { return sqlite3_column_int64(stmt_, col); }
+  double real(int col) const { return sqlite3_column_double(stmt_, col); }
+
+  std::string text(int col) const {
+    const auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt_, col));
+    return text ? std::string(text, static_cast<size_t>(sqlite3_column_bytes(stmt_, col))) : std::string();
+  }
+
+  std::vector<char> blob(int col) const {
+    const auto blob = static_cast<const char*>(sqlite3_column_blob(stmt_, col));
+    return std::vector<char>(blob, blob + sqlite3_column_bytes(stmt_, col));
+  }
+
+  // Copy a blob of exactly `size` bytes into `data`. Returns false, and
+  // copies nothing, if the blob is a different size.
+  bool blobInto(int col, void* data, size_t size) const {
+    const auto blob = sqlite3_column_blob(stmt_, col);
+    if (static_cast<size_t>(sqlite3_column_bytes(stmt_, col)) != size)
+      return false;
+
+    memcpy(data, blob, size);
+    return true;
+  }
 
-HaarSignature Image::haar() const {
-  lumin_t avglf = { avglf1, avglf2, avglf3 };
-  return HaarSignature(avglf, *(signature_t*)sig.data());
+private:
+  void bindOne(int i, int64_t value) { sqlite3_bind_int64(stmt_, i, value); }
+  void bindOne(int i, postId value) { sqlite3_bind_int64(stmt_, i, value); }
+  void bindOne(int i, double value) { sqlite3_bind_double(stmt_, i, value); }
+  void bindOne(int i, const std::string& value) { sqlite3_bind_text(stmt_, i, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT); }
+  void bindOne(int i, const std::vector<char>& value) { sqlite3_bind_blob(stmt_, i, value.data(), static_cast<int>(value.size()), SQLITE_TRANSIENT); }
+  void bindOne(int i, const md5_param& value) {
+    if (const auto digest = md5FromHex(value.md5))
+      sqlite3_bind_blob(stmt_, i, digest->data(), static_cast<int>(digest->size()), SQLITE_TRANSIENT);
+    else
+      bindOne(i, value.md5);
+  }
+
+  void bindOne(int i, const HaarSignature& value) { sqlite3_bind_blob(stmt_, i, &value, sizeof(value), SQLITE_TRANSIENT); }
+
+  sqlite3* db_;
+  sqlite3_stmt* stmt_ = nullptr;
+};
+
+// The version of the schema below, kept in PRAGMA user_version. Databases
+// from before the schema was versioned have user_version 0, and the table
+// sqlite_orm used to create, which is version 1:
+//
+//   id INTEGER PRIMARY KEY, post_id INTEGER UNIQUE, md5 TEXT UNIQUE,
+//   avglf1 REAL, avglf2 REAL, avglf3 REAL, sig BLOB
+//
+// Version 2 packs the signature into one fixed-size blob, a HaarSignature as
+// it's laid out in memory, with the coefficients of each channel already
+// sorted, so reading one is a memcpy. The md5 is stored as its 16 bytes,
+// which also halves the md5 index. An md5 that isn't valid hex is stored as
+// its text instead.
+static const int64_t schema_version = 2;
+
+static const char* images_schema =
+  "CREATE TABLE images ("
+  "id INTEGER PRIMARY KEY NOT NULL, "
+  "post_id INTEGER UNIQUE NOT NULL, "
+  "md5 BLOB UNIQUE NOT NULL, "
+  "signature BLOB NOT NULL)";
+
+#define IMAGE_COLUMNS "id, post_id, md5, signature"
+
+struct SqliteDB::statements {
+  explicit statements(sqlite3* db) :
+    begin(db, "BEGIN IMMEDIATE"),
+    commit(db, "COMMIT"),
+    rollback(db, "ROLLBACK"),
+    select_by_id(db, "SELECT " IMAGE_COLUMNS " FROM images WHERE id = ?"),
+    select_all(db, "SELECT " IMAGE_COLUMNS " FROM images ORDER BY id"),
+    insert_with_id(db, "INSERT OR IGNORE INTO images (" IMAGE_COLUMNS ") VALUES (?, ?, ?, ?)"),
+    remove_by_id(db, "DELETE FROM images WHERE id = ?"),
+    count(db, "SELECT COUNT(*) FROM images"),
+    max_post_id(db, "SELECT MAX(post_id) FROM images"),
+    max_id(db, "SELECT MAX(id) FROM images") {}
+
+  sqlite_statement begin, commit, rollback;
+  sqlite_statement select_by_id, select_all;
+  sqlite_statement insert_with_id, remove_by_id;
+  sqlite_statement count, max_post_id, max_id;
+};
+
+static Image readImage(const sqlite_statement& stmt) {
+  Image image;
+  image.id = static_cast<iqdbId>(stmt.integer(0));
+  image.post_id = static_cast<postId>(stmt.integer(1));
+
+  md5_digest digest;
+  image.md5 = stmt.isBlob(2) && stmt.blobInto(2, digest.data(), digest.size()) ? md5ToHex(digest) : stmt.text(2);
+
+  if (!stmt.blobInto(3, &image.haar, sizeof(image.haar)))
+    throw database_error("Image #" + std::to_string(image.id) + " has a damaged signature");
+
+  return image;
 }
 
-void SqliteDB::eachImage(std::function<void (const Image&)> func) {
-  for (auto& image : storage_.iterate<Image>()) {
-    func(image);
+// Run `func` in a transaction, rolling it back if `func` throws.
+template <typename F>
+static void transaction(sqlite_statement& begin, sqlite_statement& commit, sqlite_statement& rollback, F func) {
+  begin.run();
+
+  try {
+    func();
+    commit.run();
+  } catch (...) {
+    rollback.run();
+    throw;
   }
 }
 
-int SqliteDB::getImgCount()
-{
-  std::unique_lock lock(sql_mutex_);
-  
-  auto results = storage_.count(&Image::post_id);
-  if (!results) {
-    DEBUG("Couldn't count post_id in sqlite database.\n");
-    return 0;
+// The value of a single-row, single-column query, such as an aggregate.
+static int64_t queryValue(sqlite_statement& stmt) {
+  stmt.bind();
+  const int64_t value = stmt.step() ? stmt.integer(0) : 0;
+  stmt.reset();
+  return value;
+}
+
+SqliteDB::SqliteDB(const std::string& path, const SqliteOptions& options) {
+  std::string synchronous = options.synchronous;
+  std::transform(synchronous.begin(), synchronous.end(), synchronous.begin(), ::toupper);
+
+  if (synchronous != "OFF" && synchronous != "NORMAL" && synchronous != "FULL" && synchronous != "EXTRA")
+    throw param_error("Invalid synchronous setting '" + options.synchronous + "'; must be OFF, NORMAL, FULL or EXTRA");
+
+  // The connection is only ever used with sql_mutex_ held.
+  if (sqlite3_open_v2(path.c_str(), &db_, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+    const std::string error = db_ ? sqlite3_errmsg(db_) : "out of memory";
+    sqlite3_close(db_);
+    throw fatal_error("Couldn't open database " + path + ": " + error);
+  }
+
+  try {
+    // journal_mode is a no-op for in-memory databases.
+    exec("PRAGMA journal_mode = WAL");
+    exec("PRAGMA synchronous = " + synchronous);
+    exec("PRAGMA mmap_size = " + std::to_string(options.mmap_size));
+    exec("PRAGMA cache_size = " + std::to_string(-(options.cache_size / 1024))); // Negative sizes are in KiB.
+
+    migrate();
+    statements_ = std::make_unique<statements>(db_);
+  } catch (...) {
+    statements_.reset();
+    sqlite3_close(db_);
+    throw;
   }
-  return results;
+
+  image_count_ = static_cast<int>(queryValue(statements_->count));
+  max_post_id_ = static_cast<postId>(queryValue(statements_->max_post_id));
+  max_id_ = static_cast<iqdbId>(queryValue(statements_->max_id));
+}
+
+SqliteDB::~SqliteDB() {
+  // The statements must be finalized before the database can be closed.
+  statements_.reset();
+  sqlite3_close(db_);
 }
 
-postId SqliteDB::getMaxPostId()
-{
-  std::unique_lock lock(sql_mutex_);
-  
-  auto results = storage_.max(&Image::post_id);
-  if (!results) {
-    DEBUG("Couldn't count post_id in sqlite database.\n");
-    return 0;
+void SqliteDB::exec(const std::string& sql) {
+  char* error = nullptr;
+
+  if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &error) != SQLITE_OK) {
+    const std::string message = error ? error : sqlite3_errmsg(db_);
+    sqlite3_free(error);
+    throw database_error("Couldn't run `" + sql + "`: " + message);
   }
-  return *results;
 }
 
-std::optional<Image> SqliteDB::getImage(postId post_id) {
-  std::unique_lock lock(sql_mutex_);
-  
-  auto results = storage_.get_all<Image>(where(c(&Image::post_id) == post_id));
-  if (results.size() == 1) {
-    return results[0];
-  } else {
-    DEBUG("Couldn't find post #{} in sqlite database.\n", post_id);
-    return std::nullopt;
+void SqliteDB::migrate() {
+  sqlite_statement user_version(db_, "PRAGMA user_version");
+  sqlite_statement has_images(db_, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'images'");
+  int64_t version = queryValue(user_version);
+
+  if (version == 0 && queryValue(has_images))
+    version = 1;
+
+  if (version == schema_version)
+    return;
+  if (version > schema_version)
+    throw fatal_error("Database has schema version " + std::to_string(version) + ", which is newer than this version of iqdb supports (" + std::to_string(schema_version) + ")");
+
+  const bool migrating = version > 0;
+  sqlite_statement begin(db_, "BEGIN IMMEDIATE"), commit(db_, "COMMIT"), rollback(db_, "ROLLBACK");
+
+  transaction(begin, commit, rollback, [&] {
+    if (!migrating) {
+      exec(images_schema);
+      version = schema_version;
+    }
+
+    for (; version < schema_version; version++) {
+      INFO("Migrating database from schema version {} to {}...\n", version, version + 1);
+
+      if (version == 1)
+        packSignatures();
+    }
+
+    exec("PRAGMA user_version = " + std::to_string(schema_version));
+  });
+
+  // Give the space the old rows took back to the filesystem.
+  if (migrating) {
+    INFO("Vacuuming database...\n");
+    exec("VACUUM");
+  }
+}
+
+void SqliteDB::packSignatures() {
+  exec("ALTER TABLE images RENAME TO images_v1");
+  exec(images_schema);
+
+  sqlite_statement select(db_, "SELECT id, post_id, md5, avglf1, avglf2, avglf3, sig FROM images_v1");
+  sqlite_statement insert(db_, "INSERT INTO images (" IMAGE_COLUMNS ") VALUES (?, ?, ?, ?)");
+  size_t count = 0;
+
+  select.bind();
+  while (select.step()) {
+    lumin_t avglf = { select.real(3), select.real(4), select.real(5) };
+    signature_t sig;
+
+    if (!select.blobInto(6, sig, sizeof(sig)))
+      throw database_error("Image #" + std::to_string(select.integer(0)) + " has a damaged signature");
+
+    // The constructor sorts the coefficients.
+    insert.bind(select.integer(0), select.integer(1), md5_param{ select.text(2) }, HaarSignature(avglf, sig)).run();
+    count++;
   }
+
+  select.reset();
+  exec("DROP TABLE images_v1");
+
+  INFO("Packed the signatures of {} images.\n", count);
+}
+
+void SqliteDB::refreshMaxIds() {
+  max_post_id_ = static_cast<postId>(queryValue(statements_->max_post_id));
+  max_id_ = static_cast<iqdbId>(queryValue(statements_->max_id));
 }
 
-std::optional<Image> SqliteDB::getImageByMD5(const std::string& md5) {
-  std::unique_lock lock(sql_mutex_);
-  auto results = storage_.get_all<Image>(where(c(&Image::md5) == md5));
-  
-  if (results.size() == 1) {
-    return results[0];
-  } else {
-    DEBUG("Couldn't find md5 {} in sqlite database.\n", md5);
+void SqliteDB::eachImage(std::function<void (const Image&)> func) {
+  std::lock_guard lock(sql_mutex_);
+  auto& select = statements_->select_all.bind();
+
+  try {
+    while (select.step()) {
+      func(readImage(select));
+    }
+  } catch (...) {
+    select.reset();
+    throw;
+  }
+
+  select.reset();
+}
+
+std::optional<Image> SqliteDB::getImageById(iqdbId id) {
+  std::lock_guard lock(sql_mutex_);
+  auto& select = statements_->select_by_id.bind(id);
+
+  if (!select.step()) {
+    DEBUG("Couldn't find image #{} in sqlite database.\n", id);
     return std::nullopt;
   }
+
+  auto image = readImage(select);
+  select.reset();
+  return image;
 }
 
-int SqliteDB::addImage(postId post_id, const std::string& md5, HaarSignature signature, bool replace_img) {
-  int id = -1;
-  auto sig_ptr = (const char*)signature.sig;
-  std::vector<char> sig_blob(sig_ptr, sig_ptr + sizeof(signature.sig));
-  Image image {
-    0, post_id, md5, signature.avglf[0], signature.avglf[1], signature.avglf[2], sig_blob
-  };
-  
-  storage_.transaction([&] {
-    try {
-      if (replace_img)
-        removeImage(post_id);
-      id = storage_.insert(image);
-      return true; // commit
-    } catch (const std::system_error& e) {
-      // post_id unique constraint failed
-      if (e.code().value() == 19 && std::string(e.what()).find("images.post_id") != std::string::npos)
-        id = -1;
-      // md5 unique constraint failed
-      else if (e.code().value() == 19 && std::string(e.what()).find("images.md5") != std::string::npos)
-        id = -2;
-      else 
-        DEBUG("Unhandled SQLite exception, error code: {}, error msg: {}\n", e.code().value(), e.what());
-      return false; // rollback
+void SqliteDB::applyWrites(const std::vector<QueuedWrite>& writes) {
+  std::lock_guard lock(sql_mutex_);
+  auto& s = *statements_;
+  std::string conflicts;
+  size_t conflict_count = 0;
+  int added = 0;
+  int removed = 0;
+  bool removed_max = false;
+  postId max_post_id = max_post_id_;
+  iqdbId max_id = max_id_;
+
+  transaction(s.begin, s.commit, s.rollback, [&] {
+    for (const auto& write : writes) {
+      if (write.type == QueuedWrite::remove) {
+        s.remove_by_id.bind(write.id).run();
+        removed += sqlite3_changes(db_);
+        removed_max |= write.post_id == max_post_id || write.id == max_id;
+      } else {
+        s.insert_with_id.bind(write.id, write.post_id, md5_param{ write.md5 }, write.signature).run();
+
+        if (sqlite3_changes(db_) == 0) {
+          conflicts += fmt::format("{}post #{} (id {}, md5 {})", conflict_count++ ? ", " : "", write.post_id, write.id, write.md5);
+          continue;
+        }
+
+        added++;
+        max_post_id = std::max(max_post_id, write.post_id);
+        max_id = std::max(max_id, write.id);
+      }
     }
+
+    // Thrown inside the transaction, so it's rolled back.
+    if (conflict_count)
+      throw store_conflict(fmt::format("{} of {} writes to the sqlite database have a post id or md5 already in it: {}", conflict_count, writes.size(), conflicts));
   });
-  
-  return id;
-}
 
-void SqliteDB::removeImage(postId post_id) {
-  storage_.remove_all<Image>(where(c(&Image::post_id) == post_id));
+  image_count_ += added - removed;
+  max_post_id_ = max_post_id;
+  max_id_ = max_id;
+
+  if (removed_max)
+    refreshMaxIds();
 }
 
 }
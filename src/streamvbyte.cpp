@@ -0,0 +1,137 @@
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include <iqdb/streamvbyte.h>
+
+namespace iqdb {
+
+using decode_kernel = void (*)(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out);
+
+// For each control byte, the pshufb mask that scatters its four gaps into
+// four 32-bit lanes, and the total number of gap bytes it covers.
+struct StreamVByteTables {
+  uint8_t shuffle[256][16];
+  uint8_t length[256];
+
+  constexpr StreamVByteTables() : shuffle(), length() {
+    for (int ctrl = 0; ctrl < 256; ctrl++) {
+      int src = 0;
+
+      for (int lane = 0; lane < 4; lane++) {
+        const int len = ((ctrl >> (2 * lane)) & 3) + 1;
+
+        for (int byte = 0; byte < 4; byte++) {
+          // 0x80 makes pshufb write a zero byte.
+          shuffle[ctrl][4 * lane + byte] = static_cast<uint8_t>(byte < len ? src + byte : 0x80);
+        }
+
+        src += len;
+      }
+
+      length[ctrl] = static_cast<uint8_t>(src);
+    }
+  }
+};
+
+constexpr static auto streamvbyte_tables = StreamVByteTables();
+
+size_t streamvbyte_encode(const uint32_t* in, size_t n, uint32_t prev, uint8_t* out) {
+  uint8_t* ctrl = out;
+  uint8_t* data = out + (n + 3) / 4;
+
+  memset(ctrl, 0, (n + 3) / 4);
+
+  for (size_t i = 0; i < n; i++) {
+    uint32_t gap = in[i] - prev;
+    prev = in[i];
+
+    const int code = (gap > 0xFFFFFF) ? 3 : (gap > 0xFFFF) ? 2 : (gap > 0xFF) ? 1 : 0;
+    ctrl[i / 4] = static_cast<uint8_t>(ctrl[i / 4] | code << (2 * (i % 4)));
+
+    for (int byte = 0; byte <= code; byte++) {
+      *data++ = static_cast<uint8_t>(gap);
+      gap >>= 8;
+    }
+  }
+
+  return static_cast<size_t>(data - out);
+}
+
+size_t streamvbyte_encoded_size(const uint8_t* in, size_t n) {
+  size_t size = (n + 3) / 4;
+
+  for (size_t i = 0; i < n; i++) {
+    size += ((in[i / 4] >> (2 * (i % 4))) & 3) + 1u;
+  }
+
+  return size;
+}
+
+// Decode values [begin, n), given that the gap bytes of value `begin` start
+// at `data`.
+static void decode_scalar(const uint8_t* ctrl, const uint8_t* data, size_t begin, size_t n, uint32_t prev, uint32_t* out) {
+  for (size_t i = begin; i < n; i++) {
+    const int code = (ctrl[i / 4] >> (2 * (i % 4))) & 3;
+    uint32_t gap = 0;
+
+    for (int byte = 0; byte <= code; byte++) {
+      gap |= static_cast<uint32_t>(*data++) << (8 * byte);
+    }
+
+    prev += gap;
+    out[i] = prev;
+  }
+}
+
+void streamvbyte_decode_scalar(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out) {
+  decode_scalar(in, in + (n + 3) / 4, 0, n, prev, out);
+}
+
+#if defined(__x86_64__)
+
+// Decode four gaps per control byte with one shuffle, then turn the gaps
+// into values with a prefix sum across the four lanes.
+__attribute__((target("ssse3")))
+void streamvbyte_decode_ssse3(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out) {
+  const uint8_t* ctrl = in;
+  const uint8_t* data = in + (n + 3) / 4;
+  __m128i last = _mm_set1_epi32(static_cast<int>(prev));
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const uint8_t c = ctrl[i / 4];
+    const __m128i mask = _mm_loadu_si128(reinterpret_cast<const __m128i*>(streamvbyte_tables.shuffle[c]));
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data)), mask);
+
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+    v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+    v = _mm_add_epi32(v, last);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), v);
+
+    last = _mm_shuffle_epi32(v, 0xFF);
+    data += streamvbyte_tables.length[c];
+  }
+
+  decode_scalar(ctrl, data, i, n, static_cast<uint32_t>(_mm_cvtsi128_si32(last)), out);
+}
+
+#endif
+
+static decode_kernel select_decode_kernel() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("ssse3"))
+    return streamvbyte_decode_ssse3;
+#endif
+
+  return streamvbyte_decode_scalar;
+}
+
+void streamvbyte_decode(const uint8_t* in, size_t n, uint32_t prev, uint32_t* out) {
+  static const decode_kernel kernel = select_decode_kernel();
+  kernel(in, n, prev, out);
+}
+
+}
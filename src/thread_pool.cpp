@@ -0,0 +1,78 @@
+#include <algorithm>
+
+#include <iqdb/thread_pool.h>
+
+namespace iqdb {
+
+ThreadPool::ThreadPool(size_t threads, size_t max_queue) : max_queue_(max_queue) {
+  workers_.reserve(threads);
+
+  for (size_t i = 0; i < threads; i++) {
+    workers_.emplace_back([this] { run(); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stopping_ = true;
+  }
+
+  cv_.notify_all();
+
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+ThreadPool::stats ThreadPool::getStats() const {
+  using seconds = std::chrono::duration<double>;
+  std::lock_guard lock(mutex_);
+
+  return {
+    queue_.size(),
+    running_,
+    completed_,
+    rejected_,
+    seconds(wait_time_).count(),
+    seconds(max_wait_time_).count(),
+    seconds(run_time_).count(),
+  };
+}
+
+// Worker loop. Drain the queue before exiting so that no submitted task is
+// left with a broken future.
+void ThreadPool::run() {
+  while (true) {
+    std::function<void()> task;
+    clock::time_point started;
+
+    {
+      std::unique_lock lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+
+      if (queue_.empty())
+        return;
+
+      started = clock::now();
+      const auto waited = started - queue_.front().queued_at;
+      wait_time_ += waited;
+      max_wait_time_ = std::max(max_wait_time_, waited);
+      running_++;
+
+      task = std::move(queue_.front().func);
+      queue_.pop_front();
+    }
+
+    task();
+
+    {
+      std::lock_guard lock(mutex_);
+      run_time_ += clock::now() - started;
+      running_--;
+      completed_++;
+    }
+  }
+}
+
+}
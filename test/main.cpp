@@ -0,0 +1,5 @@
+// Runs the Catch2 unit tests. Build and run them with `make test`.
+// https://github.com/catchorg/Catch2/blob/v2.x/docs/tutorial.md
+
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
@@ -0,0 +1,23 @@
+#ifndef IQDB_TEST_TEMP_DIR_H
+#define IQDB_TEST_TEMP_DIR_H
+
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include <catch2/catch.hpp>
+
+// A temporary directory, removed with everything in it at the end of the test.
+struct temp_dir {
+  temp_dir() {
+    std::string pattern = (std::filesystem::temp_directory_path() / "iqdb-test-XXXXXX").string();
+    REQUIRE(mkdtemp(pattern.data()) != nullptr);
+    path = pattern;
+  }
+
+  ~temp_dir() { std::filesystem::remove_all(path); }
+
+  std::filesystem::path path;
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <iqdb/imglib.h>
+
+using namespace iqdb;
+
+// A random color signature, the same every time for the same id.
+static HaarSignature signature(imageId id) {
+  std::mt19937 rng(id);
+  lumin_t avglf = { 0.5, 0.1, 0.1 };
+  signature_t sig;
+
+  for (auto& channel : sig) {
+    std::set<int16_t> used;
+
+    for (auto& coef : channel) {
+      do {
+        coef = static_cast<int16_t>(1 + rng() % (bucket_set::n_indexes - 1));
+        coef = static_cast<int16_t>(rng() % 2 ? coef : -coef);
+      } while (!used.insert(coef).second);
+    }
+  }
+
+  return HaarSignature(avglf, sig);
+}
+
+// The ids in every non-empty bucket of the set.
+static std::map<size_t, std::vector<uint32_t>> contents(const bucket_set& set) {
+  std::map<size_t, std::vector<uint32_t>> buckets;
+  const int max_coef = static_cast<int>(bucket_set::n_indexes) - 1;
+
+  for (int c = 0; c < static_cast<int>(bucket_set::n_colors); c++) {
+    for (int coef = -max_coef; coef <= max_coef; coef++) {
+      set.at(c, coef).each(0, UINT32_MAX, [&](uint32_t id) { buckets[bucket_set::index(c, coef)].push_back(id); });
+    }
+  }
+
+  return buckets;
+}
+
+// What contents() should return for a set holding the given ids.
+static std::map<size_t, std::vector<uint32_t>> expected(const std::set<imageId>& ids) {
+  std::map<size_t, std::vector<uint32_t>> buckets;
+
+  for (const auto id : ids) {
+    bucket_set::eachBucket(signature(id), [&](size_t b) { buckets[b].push_back(id); });
+  }
+
+  return buckets;
+}
+
+TEST_CASE("Installing a merge keeps the writes made while it ran", "[buckets]") {
+  bucket_set set;
+  std::set<imageId> ids;
+
+  for (imageId id = 1; id <= 200; id++) {
+    set.add(signature(id), id);
+    ids.insert(id);
+  }
+
+  for (imageId id = 10; id < 30; id++) {
+    set.remove(id);
+    ids.erase(id);
+  }
+
+  // Merge a copy, like the maintenance thread does, then change the set.
+  const bucket_set copy = set;
+  auto merge = copy.merge();
+
+  for (imageId id = 201; id <= 220; id++) {
+    set.add(signature(id), id);
+    ids.insert(id);
+  }
+
+  std::set<imageId> removed;
+  for (imageId id = 195; id < 205; id++) {
+    set.remove(id);
+    removed.insert(id);
+  }
+
+  REQUIRE(set.install(std::move(merge)));
+
+  // Only the writes made after the merge are left over. The images removed
+  // since are still in the buckets, with tombstones.
+  CHECK(set.deltaSize() == 20 * 3 * NUM_COEFS);
+  CHECK(set.removedSize() == removed.size());
+  CHECK(contents(set) == expected(ids));
+
+  // The copy the merge was taken from is untouched.
+  CHECK(copy.removedSize() == 20);
+  CHECK(copy.deltaSize() == 200 * 3 * NUM_COEFS);
+
+  // The next merge drops the rest.
+  REQUIRE(set.install(set.merge()));
+  for (const auto id : removed) {
+    ids.erase(id);
+  }
+
+  CHECK(set.deltaSize() == 0);
+  CHECK(set.removedSize() == 0);
+  CHECK(contents(set) == expected(ids));
+}
+
+TEST_CASE("Compaction keeps up with steady deletes", "[buckets]") {
+  bucket_set set;
+  std::set<imageId> ids;
+
+  for (imageId id = 1; id <= 300; id++) {
+    set.add(signature(id), id);
+    ids.insert(id);
+  }
+
+  imageId next_removed = 1;
+  for (int round = 0; round < 5; round++) {
+    auto merge = bucket_set(set).merge();
+
+    // Deletes keep arriving while every merge runs.
+    for (int i = 0; i < 10; i++, next_removed++) {
+      set.remove(next_removed);
+    }
+
+    // Only the tombstones added during this merge are left.
+    REQUIRE(set.install(std::move(merge)));
+    CHECK(set.removedSize() == 10);
+  }
+
+  for (imageId id = 1; id < next_removed; id++) {
+    ids.erase(id);
+  }
+
+  REQUIRE(set.install(set.merge()));
+  CHECK(set.removedSize() == 0);
+  CHECK(contents(set) == expected(ids));
+}
+
+TEST_CASE("A merge is refused once another merge was installed", "[buckets]") {
+  bucket_set set;
+
+  for (imageId id = 1; id <= 10; id++) {
+    set.add(signature(id), id);
+  }
+
+  auto stale = bucket_set(set).merge();
+  set.add(signature(11), 11);
+  REQUIRE(set.install(set.merge()));
+
+  CHECK_FALSE(set.canInstall(stale));
+  CHECK_FALSE(set.install(std::move(stale)));
+  CHECK(contents(set) == expected({ 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 }));
+}
+
+TEST_CASE("Copies of a tombstone set share what they haven't changed", "[buckets]") {
+  tombstone_set removed;
+  removed.insert(5);
+  removed.insert(5);
+  removed.insert(tombstone_set::page_bits * 3 + 1);
+  CHECK(removed.size() == 2);
+
+  const tombstone_set earlier = removed;
+  removed.insert(6);
+  removed.insert(tombstone_set::page_bits * 10);
+
+  // The copy doesn't see ids added to the original after it was taken.
+  CHECK(earlier.size() == 2);
+  CHECK_FALSE(earlier.contains(6));
+  CHECK(removed.contains(6));
+  CHECK_FALSE(removed.contains(7));
+  CHECK_FALSE(removed.contains(tombstone_set::page_bits * 100));
+
+  const auto added = removed.minus(earlier);
+  CHECK(added.size() == 2);
+  CHECK(added.contains(6));
+  CHECK(added.contains(tombstone_set::page_bits * 10));
+  CHECK_FALSE(added.contains(5));
+  CHECK_FALSE(added.contains(tombstone_set::page_bits * 3 + 1));
+
+  CHECK(earlier.minus(earlier).empty());
+}
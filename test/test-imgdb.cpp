@@ -0,0 +1,100 @@
+#include <cstdint>
+#include <random>
+#include <set>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <fmt/format.h>
+
+#include <iqdb/imgdb.h>
+#include <iqdb/sqlite_db.h>
+
+#include "temp_dir.h"
+
+using namespace iqdb;
+
+// A random color signature, the same every time for the same seed.
+static HaarSignature signature(unsigned seed) {
+  std::mt19937 rng(seed);
+  lumin_t avglf = { 0.5, 0.1, 0.1 };
+  signature_t sig;
+
+  for (auto& channel : sig) {
+    std::set<int16_t> used;
+
+    for (auto& coef : channel) {
+      do {
+        coef = static_cast<int16_t>(1 + rng() % 16383);
+        coef = static_cast<int16_t>(rng() % 2 ? coef : -coef);
+      } while (!used.insert(coef).second);
+    }
+  }
+
+  return HaarSignature(avglf, sig);
+}
+
+TEST_CASE("A query's limit only reserves room for the images there are", "[imgdb]") {
+  IQDBOptions options;
+  options.query_threads = 2;
+  IQDB db(":memory:", options);
+
+  for (imageId post_id = 1; post_id <= 20; post_id++)
+    db.addImage(post_id, fmt::format("{:032x}", post_id), signature(post_id));
+
+  const auto before = db.getArenaStats();
+
+  CHECK(db.queryFromSignature(signature(1), SIZE_MAX).size() == 20);
+  CHECK(db.queryFromSignature(signature(1), 50000000).size() == 20);
+
+  const auto results = db.queryFromSignatures({ signature(1), signature(2), signature(3) }, SIZE_MAX);
+  REQUIRE(results.size() == 3);
+  for (const auto& matches : results)
+    CHECK(matches.size() == 20);
+
+  CHECK(db.getArenaStats().bytes - before.bytes < 1024 * 1024);
+}
+
+// Add post 5 to the database behind the index's back, so that the two
+// disagree about it.
+static void addBehindIndex(const std::string& path) {
+  SqliteDB(path).applyWrites({ { QueuedWrite::add, 100, 5, fmt::format("{:032x}", 5), signature(5) } });
+}
+
+TEST_CASE("A change the store refuses isn't published to the index", "[imgdb]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  IQDB db(path);
+
+  db.addImage(1, fmt::format("{:032x}", 1), signature(1));
+  addBehindIndex(path);
+
+  CHECK_THROWS_AS(db.addImage(5, fmt::format("{:032x}", 50), signature(5)), store_conflict);
+  CHECK(db.getStoreConflicts() == 1);
+  CHECK(db.getImgCount() == 1);
+  CHECK_FALSE(db.getImage(5));
+  CHECK(db.queryFromSignature(signature(5), 10).size() == 1);
+}
+
+TEST_CASE("Queued writes the store refuses are dropped, the rest committed", "[imgdb]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  IQDBOptions options;
+  options.commit_delay_ms = 60 * 60 * 1000;
+
+  {
+    IQDB db(path, options);
+    addBehindIndex(path);
+
+    db.addImage(4, fmt::format("{:032x}", 4), signature(4));
+    db.addImage(5, fmt::format("{:032x}", 50), signature(5));
+    db.addImage(6, fmt::format("{:032x}", 6), signature(6));
+    db.flush();
+
+    CHECK(db.getStoreConflicts() == 1);
+    CHECK(db.getQueuedWrites() == 0);
+  }
+
+  SqliteDB store(path);
+  CHECK(store.getImgCount() == 3);
+  CHECK(store.getMaxPostId() == 6);
+}
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <fmt/format.h>
+
+#include <iqdb/haar.h>
+#include <iqdb/haar_signature.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/resizer.h>
+
+using namespace iqdb;
+
+// JPEGs decoded at 1/2, 1/4 or 1/8 scale by libjpeg should look almost the
+// same to IQDB as when they're fully decoded by libgd and then resized.
+static const Score min_scaled_score = 95;
+
+struct jpeg_fixture {
+  std::string name;
+  std::string data;
+  bool scaled; // Whether it's big enough to be decoded at a reduced scale.
+};
+
+static std::string encode_jpeg(gdImagePtr img, bool progressive) {
+  int size = 0;
+  gdImageInterlace(img, progressive);
+  void *data = gdImageJpegPtr(img, &size, 90);
+  REQUIRE(data);
+
+  std::string jpeg(static_cast<const char *>(data), static_cast<size_t>(size));
+  gdFree(data);
+  return jpeg;
+}
+
+// A photo-like test image: smooth gradients, a few hard-edged shapes and a
+// little noise, in color or in grayscale.
+static std::string synthetic_jpeg(int w, int h, bool color, bool progressive = false) {
+  RawImage img(gdImageCreateTrueColor(w, h), &gdImageDestroy);
+  REQUIRE(img);
+  unsigned int noise = 12345;
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      const double u = (double)x / w, v = (double)y / h;
+      noise = noise * 1103515245 + 12345;
+
+      int r = (int)(255 * u), g = (int)(255 * v), b = (int)(128 + 127 * std::sin(6 * u + 4 * v));
+      if (std::hypot(u - 0.3, v - 0.4) < 0.2)
+        r = g = b = 30;
+      if (u > 0.6 && u < 0.9 && v > 0.55 && v < 0.8)
+        r = 240, g = 200, b = 40;
+
+      const int n = (int)(noise >> 28) - 8;
+      r = std::clamp(r + n, 0, 255), g = std::clamp(g + n, 0, 255), b = std::clamp(b + n, 0, 255);
+
+      if (!color)
+        r = g = b = (r * 3 + g * 6 + b) / 10;
+
+      img->tpixels[y][x] = gdTrueColor(r, g, b);
+    }
+  }
+
+  return encode_jpeg(img.get(), progressive);
+}
+
+static std::string read_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  REQUIRE(file);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// A real photo, blown up to a size that's decoded at 1/8 scale.
+static std::string upscaled_jpeg(const std::string& jpeg, int w, int h) {
+  RawImage small(gdImageCreateFromJpegPtr((int)jpeg.size(), const_cast<char *>(jpeg.data())), &gdImageDestroy);
+  RawImage big(gdImageCreateTrueColor(w, h), &gdImageDestroy);
+  REQUIRE(small);
+  REQUIRE(big);
+
+  gdImageCopyResampled(big.get(), small.get(), 0, 0, 0, 0, w, h, small->sx, small->sy);
+  return encode_jpeg(big.get(), false);
+}
+
+// The signature of a JPEG decoded at full size by libgd, then resized.
+static HaarSignature full_decode_signature(const std::string& jpeg) {
+  static Unit cdata[3][NUM_PIXELS * NUM_PIXELS];
+  HaarSignature signature;
+
+  RawImage img(gdImageCreateFromJpegPtr((int)jpeg.size(), const_cast<char *>(jpeg.data())), &gdImageDestroy);
+  RawImage thumb(gdImageCreateTrueColor(NUM_PIXELS, NUM_PIXELS), &gdImageDestroy);
+  REQUIRE(img);
+  REQUIRE(thumb);
+
+  gdImageCopyResampled(thumb.get(), img.get(), 0, 0, 0, 0, NUM_PIXELS, NUM_PIXELS, img->sx, img->sy);
+  transformPixels(thumb->tpixels, cdata[0], cdata[1], cdata[2]);
+  calcHaar(cdata[0], cdata[1], cdata[2], signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
+  return signature;
+}
+
+TEST_CASE("JPEGs scaled down while decoding score like fully decoded ones", "[jpeg]") {
+  const auto photo = read_file(IQDB_SOURCE_DIR "/files/1.jpg");
+
+  const std::vector<jpeg_fixture> fixtures = {
+    { "photo 106x150 (progressive)", photo, false },
+    { "photo 1600x2264", upscaled_jpeg(photo, 1600, 2264), true },
+    { "color 300x200", synthetic_jpeg(300, 200, true), false },
+    { "color 640x480", synthetic_jpeg(640, 480, true), true },
+    { "color 1024x1024", synthetic_jpeg(1024, 1024, true), true },
+    { "color 4000x3000", synthetic_jpeg(4000, 3000, true), true },
+    { "color 3000x700 (progressive)", synthetic_jpeg(3000, 700, true, true), true },
+    { "grayscale 1200x900", synthetic_jpeg(1200, 900, false), true },
+  };
+
+  // Index the fully decoded signatures, then look each image up with the
+  // signature of the scaled-down decode.
+  IQDB db;
+  for (size_t i = 0; i < fixtures.size(); i++) {
+    db.addImage(static_cast<imageId>(i + 1), fmt::format("{:032x}", i + 1), full_decode_signature(fixtures[i].data));
+  }
+
+  for (size_t i = 0; i < fixtures.size(); i++) {
+    const auto& fixture = fixtures[i];
+    INFO(fixture.name);
+
+    const auto signature = HaarSignature::from_file_content(fixture.data);
+    const auto results = db.queryFromSignature(signature, 1);
+    REQUIRE(results.size() == 1);
+
+    CHECK(results[0].id == i + 1);
+    if (fixture.scaled)
+      CHECK(results[0].score >= min_scaled_score);
+    else
+      CHECK(results[0].score == Approx(100));
+  }
+}
@@ -0,0 +1,228 @@
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <fmt/format.h>
+
+#include <iqdb/imgdb.h>
+#include <iqdb/log_db.h>
+
+#include "temp_dir.h"
+
+using namespace iqdb;
+namespace fs = std::filesystem;
+
+// The image with the given id, the same every time.
+static QueuedWrite add(iqdbId id) {
+  lumin_t avglf = { 0.5, 0.1 * static_cast<double>(id % 7), 0.2 };
+  signature_t sig;
+
+  for (int c = 0; c < 3; c++) {
+    for (int i = 0; i < NUM_COEFS; i++)
+      sig[c][i] = static_cast<int16_t>(static_cast<int>(id % 1000) + c * NUM_COEFS + i);
+  }
+
+  return { QueuedWrite::add, id, static_cast<postId>(id + 1000), fmt::format("{:032x}", id), HaarSignature(avglf, sig) };
+}
+
+static QueuedWrite remove(iqdbId id) {
+  return { QueuedWrite::remove, id, static_cast<postId>(id + 1000), "", {} };
+}
+
+// Every image in the log, by id.
+static std::map<iqdbId, Image> contents(LogDB& db) {
+  std::map<iqdbId, Image> images;
+  db.eachImage([&](const Image& image) { images[image.id] = image; });
+  return images;
+}
+
+// Check that the log holds exactly the images add() makes for the given ids.
+static void check(LogDB& db, const std::vector<iqdbId>& ids) {
+  const auto images = contents(db);
+
+  REQUIRE(db.getImgCount() == static_cast<int>(ids.size()));
+  REQUIRE(images.size() == ids.size());
+
+  for (const auto id : ids) {
+    const auto expected = add(id);
+    const auto it = images.find(id);
+
+    REQUIRE(it != images.end());
+    CHECK(it->second.post_id == expected.post_id);
+    CHECK(it->second.md5 == expected.md5);
+    CHECK(it->second.haar.to_string() == expected.signature.to_string());
+  }
+}
+
+TEST_CASE("A log plays back the images written to it", "[log_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.log").string();
+
+  {
+    LogDB db(path);
+    db.applyWrites({ add(1), add(2), add(3) });
+    db.applyWrites({ remove(2), add(4) });
+
+    // A duplicate id or a bad md5 fails the whole batch.
+    auto bad_md5 = add(6);
+    bad_md5.md5 = "not an md5";
+    CHECK_THROWS_AS(db.applyWrites({ add(5), add(1) }), store_conflict);
+    CHECK_THROWS_AS(db.applyWrites({ add(5), bad_md5 }), store_conflict);
+    check(db, { 1, 3, 4 });
+  }
+
+  LogDB db(path);
+  check(db, { 1, 3, 4 });
+  CHECK(db.getMaxId() == 4);
+  CHECK(db.getMaxPostId() == 1004);
+  CHECK(db.getImageById(3)->md5 == add(3).md5);
+  CHECK_FALSE(db.getImageById(2));
+}
+
+TEST_CASE("A batch cut short by a crash is dropped when the log is opened", "[log_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.log").string();
+  uintmax_t complete_size;
+
+  {
+    LogDB db(path);
+    db.applyWrites({ add(1), add(2) });
+    complete_size = fs::file_size(path);
+    db.applyWrites({ remove(1), add(3), add(4) });
+  }
+
+  SECTION("with a partial last record") {
+    fs::resize_file(path, fs::file_size(path) - 10);
+  }
+
+  SECTION("with garbage after it") {
+    fs::resize_file(path, complete_size);
+    std::ofstream(path, std::ios::app | std::ios::binary) << std::string(1000, '\xab');
+  }
+
+  {
+    LogDB db(path);
+    check(db, { 1, 2 });
+    CHECK(fs::file_size(path) == complete_size);
+
+    // New writes go where the torn batch was.
+    db.applyWrites({ add(5) });
+  }
+
+  LogDB db(path);
+  check(db, { 1, 2, 5 });
+}
+
+TEST_CASE("Compacting a log keeps only the live images", "[log_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.log").string();
+  std::vector<iqdbId> live;
+
+  {
+    LogDB db(path);
+    std::vector<QueuedWrite> adds, removes;
+
+    for (iqdbId id = 1; id <= 100; id++) {
+      adds.push_back(add(id));
+      if (id % 3)
+        removes.push_back(remove(id));
+      else
+        live.push_back(id);
+    }
+
+    db.applyWrites(adds);
+    db.applyWrites(removes);
+
+    const auto old_size = fs::file_size(path);
+    db.compact();
+
+    CHECK(fs::file_size(path) < old_size / 3);
+    CHECK_FALSE(fs::exists(path + ".tmp"));
+    check(db, live);
+
+    db.applyWrites({ add(101), remove(3) });
+    live.push_back(101);
+    live.erase(live.begin());
+  }
+
+  LogDB db(path);
+  check(db, live);
+  CHECK(db.getMaxId() == 101);
+}
+
+TEST_CASE("A log compacts itself once most of it is dead", "[log_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.log").string();
+  LogOptions options;
+  options.sync = false;
+  options.compact_min_records = 16;
+
+  {
+    LogDB db(path, options);
+
+    for (iqdbId id = 1; id <= 20; id++)
+      db.applyWrites({ add(id) });
+
+    const auto full_size = fs::file_size(path);
+    for (iqdbId id = 1; id <= 15; id++)
+      db.applyWrites({ remove(id) });
+
+    // It happens in the background, so wait for it.
+    for (int i = 0; i < 500 && fs::file_size(path) >= full_size; i++)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    CHECK(fs::file_size(path) < full_size);
+    check(db, { 16, 17, 18, 19, 20 });
+  }
+
+  LogDB db(path, options);
+  check(db, { 16, 17, 18, 19, 20 });
+}
+
+TEST_CASE("Writes made while a log is compacted are kept", "[log_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.log").string();
+  LogOptions options;
+  options.sync = false;
+  options.compact_min_records = SIZE_MAX; // Only compact when asked to.
+  std::vector<iqdbId> live;
+
+  {
+    LogDB db(path, options);
+    std::vector<QueuedWrite> adds;
+
+    for (iqdbId id = 1; id <= 5000; id++)
+      adds.push_back(add(id));
+    db.applyWrites(adds);
+
+    std::atomic<bool> done = false;
+    std::thread compactor([&] {
+      while (!done)
+        db.compact();
+    });
+
+    // Remove every other image, and add some new ones, a few at a time.
+    for (iqdbId id = 1; id <= 5000; id += 2)
+      db.applyWrites({ remove(id), add(id + 5000) });
+
+    done = true;
+    compactor.join();
+    db.compact();
+
+    for (iqdbId id = 2; id <= 5000; id += 2)
+      live.push_back(id);
+    for (iqdbId id = 5001; id <= 10000; id += 2)
+      live.push_back(id);
+
+    check(db, live);
+  }
+
+  LogDB db(path, options);
+  check(db, live);
+}
@@ -0,0 +1,198 @@
+#include <png.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <fmt/format.h>
+
+#include <iqdb/haar.h>
+#include <iqdb/haar_signature.h>
+#include <iqdb/imgdb.h>
+#include <iqdb/resizer.h>
+
+using namespace iqdb;
+
+// PNGs reduced while they're read, because they're too big to decode at
+// full size, should look almost the same to IQDB as when they're fully
+// decoded by libgd and then resized.
+static const Score min_reduced_score = 95;
+
+// A small max_decode_pixels, which every fixture bigger than 256x256 goes
+// over at full size but not once it's reduced.
+static const uint64_t reduced_decode_pixels = 200000;
+
+struct png_fixture {
+  std::string name;
+  std::string data;
+  bool reduced; // Whether it's too big to decode at full size with reduced_decode_pixels.
+};
+
+// A test image: smooth gradients, a few hard-edged shapes and a little
+// noise, with a fully transparent band of colored pixels and a
+// half-transparent one.
+static std::array<int, 4> pixel(int x, int y, int w, int h) {
+  const double u = (double)x / w, v = (double)y / h;
+  const unsigned int noise = (unsigned int)(x * 7919 + y * 104729) * 2654435761u;
+
+  int r = (int)(255 * u), g = (int)(255 * v), b = (int)(128 + 127 * std::sin(6 * u + 4 * v)), a = 255;
+  if (std::hypot(u - 0.3, v - 0.4) < 0.2)
+    r = g = b = 30;
+  if (u > 0.6 && u < 0.9 && v > 0.55 && v < 0.8)
+    r = 240, g = 200, b = 40;
+  if (v > 0.85)
+    a = 0;
+  else if (u < 0.1)
+    a = 128;
+
+  const int n = (int)(noise >> 28) - 8;
+  return { std::clamp(r + n, 0, 255), std::clamp(g + n, 0, 255), std::clamp(b + n, 0, 255), a };
+}
+
+static void png_append(png_structp png, png_bytep data, size_t n) {
+  static_cast<std::string *>(png_get_io_ptr(png))->append(reinterpret_cast<const char *>(data), n);
+}
+
+// Encode a w * h test image as a PNG of the given color type and bit depth.
+// Palette images get a 64 color palette, plus fully and half transparent
+// entries in a tRNS chunk.
+static std::string encode_png(int w, int h, int color_type, int bit_depth) {
+  std::string out;
+  const int channels = color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 : color_type == PNG_COLOR_TYPE_RGB ? 3 : color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+  const int bytes = bit_depth / 8;
+  std::vector<png_byte> row((size_t)w * channels * bytes);
+
+  png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+  png_infop info = png_create_info_struct(png);
+  REQUIRE(info);
+
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_write_struct(&png, &info);
+    FAIL("Couldn't encode PNG");
+  }
+
+  png_set_write_fn(png, &out, png_append, nullptr);
+  png_set_IHDR(png, info, w, h, bit_depth, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    std::vector<png_color> palette;
+    for (int i = 0; i < 64; i++)
+      palette.push_back({ (png_byte)((i >> 4) * 85), (png_byte)((i >> 2 & 3) * 85), (png_byte)((i & 3) * 85) });
+    palette.push_back({ 200, 50, 50 }); // Fully transparent.
+    palette.push_back({ 50, 50, 200 }); // Half transparent.
+
+    std::vector<png_byte> alpha(64, 255);
+    alpha.push_back(0);
+    alpha.push_back(128);
+
+    png_set_PLTE(png, info, palette.data(), (int)palette.size());
+    png_set_tRNS(png, info, alpha.data(), (int)alpha.size(), nullptr);
+  }
+
+  png_write_info(png, info);
+
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      const auto p = pixel(x, y, w, h);
+      const int gray = (p[0] * 3 + p[1] * 6 + p[2] * 1) / 10;
+      std::array<int, 4> values;
+
+      if (color_type == PNG_COLOR_TYPE_PALETTE)
+        values = { p[3] == 0 ? 64 : p[3] < 255 ? 65 : (p[0] / 64) << 4 | (p[1] / 64) << 2 | p[2] / 64 };
+      else if (channels <= 2)
+        values = { gray, p[3] };
+      else
+        values = p;
+
+      for (int c = 0; c < channels; c++) {
+        png_byte *sample = &row[((size_t)x * channels + c) * bytes];
+        sample[0] = (png_byte)values[c];
+
+        // 16-bit samples get low bytes that differ from their high bytes.
+        if (bytes == 2)
+          sample[1] = (png_byte)(values[c] ^ (x + y));
+      }
+    }
+
+    png_write_row(png, row.data());
+  }
+
+  png_write_end(png, info);
+  png_destroy_write_struct(&png, &info);
+  return out;
+}
+
+// The signature of a PNG decoded at full size by libgd, then resized unless
+// it's already a truecolor image of the right size. This is how every PNG
+// used to be hashed.
+static HaarSignature full_decode_signature(const std::string& png) {
+  static Unit cdata[3][NUM_PIXELS * NUM_PIXELS];
+  HaarSignature signature;
+
+  RawImage img(gdImageCreateFromPngPtr((int)png.size(), const_cast<char *>(png.data())), &gdImageDestroy);
+  REQUIRE(img);
+
+  if (img->sx != NUM_PIXELS || img->sy != NUM_PIXELS || !gdImageTrueColor(img)) {
+    RawImage thumb(gdImageCreateTrueColor(NUM_PIXELS, NUM_PIXELS), &gdImageDestroy);
+    REQUIRE(thumb);
+
+    gdImageCopyResampled(thumb.get(), img.get(), 0, 0, 0, 0, NUM_PIXELS, NUM_PIXELS, img->sx, img->sy);
+    img = std::move(thumb);
+  }
+
+  transformPixels(img->tpixels, cdata[0], cdata[1], cdata[2]);
+  calcHaar(cdata[0], cdata[1], cdata[2], signature.sig[0], signature.sig[1], signature.sig[2], signature.avglf);
+  return signature;
+}
+
+static std::vector<png_fixture> fixtures() {
+  return {
+    { "RGBA 128x128", encode_png(128, 128, PNG_COLOR_TYPE_RGB_ALPHA, 8), false },
+    { "palette+tRNS 128x128", encode_png(128, 128, PNG_COLOR_TYPE_PALETTE, 8), false },
+    { "RGB 300x200", encode_png(300, 200, PNG_COLOR_TYPE_RGB, 8), false },
+    { "RGBA 1024x1024", encode_png(1024, 1024, PNG_COLOR_TYPE_RGB_ALPHA, 8), true },
+    { "palette+tRNS 800x600", encode_png(800, 600, PNG_COLOR_TYPE_PALETTE, 8), true },
+    { "16-bit RGB 1024x768", encode_png(1024, 768, PNG_COLOR_TYPE_RGB, 16), true },
+    { "16-bit RGBA 900x900", encode_png(900, 900, PNG_COLOR_TYPE_RGB_ALPHA, 16), true },
+    { "gray+alpha 2000x1500", encode_png(2000, 1500, PNG_COLOR_TYPE_GRAY_ALPHA, 8), true },
+  };
+}
+
+TEST_CASE("PNGs that fit in memory are hashed as they always were", "[png]") {
+  for (const auto& fixture : fixtures()) {
+    INFO(fixture.name);
+    CHECK(HaarSignature::from_file_content(fixture.data).to_string() == full_decode_signature(fixture.data).to_string());
+  }
+}
+
+TEST_CASE("PNGs reduced while decoding score like fully decoded ones", "[png]") {
+  const auto images = fixtures();
+  decode_limits limits;
+  limits.max_decode_pixels = reduced_decode_pixels;
+
+  // Index the fully decoded signatures, then look each image up with the
+  // signature of the reduced decode.
+  IQDB db;
+  for (size_t i = 0; i < images.size(); i++) {
+    db.addImage(static_cast<imageId>(i + 1), fmt::format("{:032x}", i + 1), full_decode_signature(images[i].data));
+  }
+
+  for (size_t i = 0; i < images.size(); i++) {
+    const auto& fixture = images[i];
+    INFO(fixture.name);
+
+    if (!fixture.reduced)
+      continue;
+
+    const auto signature = HaarSignature::from_file_content(fixture.data, limits);
+    const auto results = db.queryFromSignature(signature, 1);
+    REQUIRE(results.size() == 1);
+
+    CHECK(signature.to_string() != full_decode_signature(fixture.data).to_string());
+    CHECK(results[0].id == i + 1);
+    CHECK(results[0].score >= min_reduced_score);
+  }
+}
@@ -0,0 +1,168 @@
+#include <sqlite3.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <catch2/catch.hpp>
+#include <fmt/format.h>
+
+#include <iqdb/imgdb.h>
+#include <iqdb/sqlite_db.h>
+
+#include "temp_dir.h"
+
+using namespace iqdb;
+
+// Run SQL against a database file directly, without SqliteDB.
+static void execSql(const std::string& path, const std::string& sql) {
+  sqlite3* db = nullptr;
+  REQUIRE(sqlite3_open(path.c_str(), &db) == SQLITE_OK);
+
+  char* error = nullptr;
+  const int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &error);
+  const std::string message = error ? error : "";
+  sqlite3_free(error);
+  sqlite3_close(db);
+
+  INFO(message);
+  REQUIRE(rc == SQLITE_OK);
+}
+
+static int64_t userVersion(const std::string& path) {
+  sqlite3* db = nullptr;
+  sqlite3_stmt* stmt = nullptr;
+  REQUIRE(sqlite3_open(path.c_str(), &db) == SQLITE_OK);
+  REQUIRE(sqlite3_prepare_v2(db, "PRAGMA user_version", -1, &stmt, nullptr) == SQLITE_OK);
+  REQUIRE(sqlite3_step(stmt) == SQLITE_ROW);
+
+  const int64_t version = sqlite3_column_int64(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_close(db);
+  return version;
+}
+
+// The unsorted signature of the image with the given id, as the old IQDB
+// stored it.
+static std::vector<int16_t> unsortedSignature(iqdbId id) {
+  std::vector<int16_t> sig;
+
+  for (int c = 0; c < 3; c++) {
+    for (int i = NUM_COEFS - 1; i >= 0; i--)
+      sig.push_back(static_cast<int16_t>((i % 2 ? -1 : 1) * static_cast<int>(id * 10 + static_cast<iqdbId>(c * NUM_COEFS + i) + 1)));
+  }
+
+  return sig;
+}
+
+// Create a database with a version 1 images table, from before the schema
+// was versioned, holding the images with ids 1..count. Image 2 has an md5
+// that isn't hex, but is 16 characters long, the size of a digest.
+static void createV1Database(const std::string& path, iqdbId count) {
+  std::string sql =
+    "CREATE TABLE images (id INTEGER PRIMARY KEY NOT NULL, post_id INTEGER UNIQUE NOT NULL, md5 TEXT UNIQUE NOT NULL, "
+    "avglf1 REAL NOT NULL, avglf2 REAL NOT NULL, avglf3 REAL NOT NULL, sig BLOB NOT NULL);";
+
+  for (iqdbId id = 1; id <= count; id++) {
+    const auto md5 = id == 2 ? std::string("not-an-md5-hash!") : fmt::format("{:032x}", id);
+    const auto sig = unsortedSignature(id);
+    std::string hex;
+
+    for (const auto coef : sig)
+      hex += fmt::format("{:02x}{:02x}", static_cast<uint16_t>(coef) & 0xFF, static_cast<uint16_t>(coef) >> 8);
+
+    sql += fmt::format("INSERT INTO images VALUES ({}, {}, '{}', 0.5, {}, -0.25, x'{}');", id, id + 100, md5, static_cast<double>(id) / 100, hex);
+  }
+
+  execSql(path, sql);
+}
+
+TEST_CASE("Version 1 databases are migrated to version 2", "[sqlite_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  createV1Database(path, 50);
+  REQUIRE(userVersion(path) == 0);
+
+  {
+    SqliteDB db(path);
+    REQUIRE(db.getImgCount() == 50);
+    CHECK(db.getMaxId() == 50);
+    CHECK(db.getMaxPostId() == 150);
+
+    iqdbId next = 1;
+    db.eachImage([&](const Image& image) {
+      REQUIRE(image.id == next++);
+      CHECK(image.post_id == static_cast<postId>(image.id + 100));
+      CHECK(image.md5 == (image.id == 2 ? std::string("not-an-md5-hash!") : fmt::format("{:032x}", image.id)));
+      CHECK(image.haar.avglf[0] == 0.5);
+      CHECK(image.haar.avglf[1] == static_cast<double>(image.id) / 100);
+      CHECK(image.haar.avglf[2] == -0.25);
+
+      // The coefficients of each channel are sorted.
+      auto sig = unsortedSignature(image.id);
+      for (int c = 0; c < 3; c++) {
+        std::sort(sig.begin() + c * NUM_COEFS, sig.begin() + (c + 1) * NUM_COEFS);
+        CHECK(std::equal(sig.begin() + c * NUM_COEFS, sig.begin() + (c + 1) * NUM_COEFS, image.haar.sig[c]));
+      }
+    });
+
+    CHECK(next == 51);
+  }
+
+  CHECK(userVersion(path) == 2);
+
+  // Opening it again doesn't migrate it again.
+  SqliteDB db(path);
+  CHECK(db.getImgCount() == 50);
+  CHECK(db.getImageById(2)->md5 == "not-an-md5-hash!");
+  CHECK(db.getImageById(3)->md5 == fmt::format("{:032x}", 3));
+}
+
+TEST_CASE("An md5 that isn't hex is kept as text", "[sqlite_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  const std::vector<std::string> md5s = { "0123456789abcdef0123456789abcdef", "0123456789abcdef", "not-an-md5-hash!", "short" };
+
+  {
+    SqliteDB db(path);
+    std::vector<QueuedWrite> writes;
+
+    for (size_t i = 0; i < md5s.size(); i++)
+      writes.push_back({ QueuedWrite::add, static_cast<iqdbId>(i + 1), static_cast<postId>(i + 1), md5s[i], {} });
+
+    db.applyWrites(writes);
+  }
+
+  SqliteDB db(path);
+  for (size_t i = 0; i < md5s.size(); i++)
+    CHECK(db.getImageById(static_cast<iqdbId>(i + 1))->md5 == md5s[i]);
+}
+
+TEST_CASE("A batch with a conflicting add is rolled back", "[sqlite_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  const auto add = [](iqdbId id, postId post_id, iqdbId md5) {
+    return QueuedWrite{ QueuedWrite::add, id, post_id, fmt::format("{:032x}", md5), {} };
+  };
+
+  SqliteDB db(path);
+  db.applyWrites({ add(1, 101, 1), add(2, 102, 2) });
+
+  CHECK_THROWS_AS(db.applyWrites({ add(3, 103, 3), add(4, 101, 4) }), store_conflict);
+  CHECK_THROWS_AS(db.applyWrites({ add(3, 103, 3), add(4, 104, 2) }), store_conflict);
+  CHECK_THROWS_AS(db.applyWrites({ { QueuedWrite::remove, 1, 101, "", {} }, add(3, 103, 3), add(4, 102, 4) }), store_conflict);
+
+  CHECK(db.getImgCount() == 2);
+  CHECK(db.getMaxId() == 2);
+  CHECK(db.getMaxPostId() == 102);
+  CHECK(db.getImageById(1));
+  CHECK_FALSE(db.getImageById(3));
+}
+
+TEST_CASE("Databases from a newer version of iqdb aren't opened", "[sqlite_db]") {
+  temp_dir dir;
+  const auto path = (dir.path / "iqdb.sqlite").string();
+  execSql(path, "CREATE TABLE images (id INTEGER PRIMARY KEY); PRAGMA user_version = 3;");
+
+  CHECK_THROWS_AS(SqliteDB(path), fatal_error);
+}
@@ -0,0 +1,112 @@
+#include <random>
+#include <vector>
+
+#include <catch2/catch.hpp>
+
+#include <iqdb/imglib.h>
+#include <iqdb/streamvbyte.h>
+
+using namespace iqdb;
+
+// Sorted ids whose gaps take 1, 2, 3 and 4 bytes, in a random mix. Short
+// enough lists (up to about 900 ids) don't overflow.
+static std::vector<uint32_t> random_ids(size_t n, uint32_t first, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<uint32_t> ids;
+  uint32_t id = first;
+
+  for (size_t i = 0; i < n; i++) {
+    const auto bytes = rng() % 4;
+    id += static_cast<uint32_t>((bytes == 0 ? 1u : 1u << (8 * bytes)) + rng() % 0xFF);
+    ids.push_back(id);
+  }
+
+  return ids;
+}
+
+static std::vector<uint8_t> encode(const std::vector<uint32_t>& ids, uint32_t prev) {
+  std::vector<uint8_t> data(streamvbyte_max_bytes(ids.size()) + streamvbyte_padding);
+  const size_t used = streamvbyte_encode(ids.data(), ids.size(), prev, data.data());
+
+  REQUIRE(used <= streamvbyte_max_bytes(ids.size()));
+  REQUIRE(streamvbyte_encoded_size(data.data(), ids.size()) == used);
+  return data;
+}
+
+TEST_CASE("Stream VByte round-trips every length", "[streamvbyte]") {
+  for (size_t n : { 0, 1, 2, 3, 4, 5, 7, 8, 127, 128, 129, 255, 256, 257, 513 }) {
+    const auto ids = random_ids(n, 1000, static_cast<unsigned>(n));
+    const auto data = encode(ids, 1000);
+    std::vector<uint32_t> out(n);
+
+    INFO("n = " << n);
+
+    streamvbyte_decode_scalar(data.data(), n, 1000, out.data());
+    CHECK(out == ids);
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) {
+      std::fill(out.begin(), out.end(), 0);
+      streamvbyte_decode_ssse3(data.data(), n, 1000, out.data());
+      CHECK(out == ids);
+    }
+#endif
+
+    std::fill(out.begin(), out.end(), 0);
+    streamvbyte_decode(data.data(), n, 1000, out.data());
+    CHECK(out == ids);
+  }
+}
+
+TEST_CASE("Stream VByte handles gaps of zero and the largest ids", "[streamvbyte]") {
+  const std::vector<uint32_t> ids = { 5, 5, 5, 6, 0xFFFF, 0x10000, 0xFFFFFF, 0x1000000, 0xFFFFFFFE, 0xFFFFFFFF };
+  const auto data = encode(ids, 5);
+  std::vector<uint32_t> scalar(ids.size()), fast(ids.size());
+
+  streamvbyte_decode_scalar(data.data(), ids.size(), 5, scalar.data());
+  streamvbyte_decode(data.data(), ids.size(), 5, fast.data());
+
+  CHECK(scalar == ids);
+  CHECK(fast == ids);
+}
+
+TEST_CASE("Posting segments decode across block boundaries", "[streamvbyte][buckets]") {
+  const size_t block = posting_segment::block_size;
+  const std::vector<size_t> sizes = { 0, 1, block - 1, block, block + 1, 3 * block + 5 };
+  std::vector<std::vector<uint32_t>> buckets;
+  posting_segment segment;
+
+  for (size_t i = 0; i < sizes.size(); i++) {
+    buckets.push_back(random_ids(sizes[i], 0, static_cast<unsigned>(i)));
+    segment.append(buckets[i].data(), buckets[i].size());
+  }
+
+  segment.finish();
+  REQUIRE(segment.buckets() == sizes.size());
+
+  for (size_t b = 0; b < sizes.size(); b++) {
+    const auto& ids = buckets[b];
+    std::vector<uint32_t> out;
+
+    INFO("bucket " << b << " holds " << ids.size() << " ids");
+
+    segment.decode(b, out);
+    CHECK(out == ids);
+
+    // Ranges that start and end inside, between and at the edges of blocks.
+    for (size_t first : { size_t(0), block - 1, block, block + 1, 2 * block }) {
+      for (size_t last : { first, first + 1, block, block + 2, 3 * block + 5 }) {
+        if (first > last || last > ids.size())
+          continue;
+
+        const uint32_t begin = first < ids.size() ? ids[first] : UINT32_MAX;
+        const uint32_t end = last < ids.size() ? ids[last] : UINT32_MAX;
+        std::vector<uint32_t> expected(ids.begin() + static_cast<std::ptrdiff_t>(first), ids.begin() + static_cast<std::ptrdiff_t>(last));
+
+        out.clear();
+        segment.each(b, begin, end, [&](uint32_t id) { out.push_back(id); });
+        CHECK(out == expected);
+      }
+    }
+  }
+}
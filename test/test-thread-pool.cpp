@@ -0,0 +1,46 @@
+#include <future>
+#include <thread>
+
+#include <catch2/catch.hpp>
+
+#include <iqdb/thread_pool.h>
+
+using namespace iqdb;
+
+TEST_CASE("trySubmit() only queues batches that fit", "[thread_pool]") {
+  ThreadPool pool(1, 4);
+  std::promise<void> release;
+  auto released = release.get_future().share();
+
+  // Keep the only worker busy, so everything else stays queued.
+  auto blocker = pool.trySubmit([released] { released.wait(); return 0; });
+  REQUIRE(blocker);
+  while (pool.getStats().running == 0) {
+    std::this_thread::yield();
+  }
+
+  const auto identity = [](size_t i) { return i; };
+
+  CHECK(pool.trySubmit(3, identity));
+  CHECK_FALSE(pool.trySubmit(2, identity)); // 3 + 2 don't fit in 4.
+  CHECK(pool.trySubmit(1, identity));
+  CHECK_FALSE(pool.trySubmit(1, identity)); // Full.
+  CHECK(pool.getStats().queued == 4);
+  CHECK(pool.getStats().rejected == 3);
+
+  release.set_value();
+}
+
+TEST_CASE("trySubmit() never queues a batch larger than the queue", "[thread_pool]") {
+  ThreadPool pool(2, 4);
+  const auto identity = [](size_t i) { return i; };
+
+  CHECK_FALSE(pool.trySubmit(5, identity));
+  CHECK(pool.getStats().queued == 0);
+
+  auto futures = pool.trySubmit(4, identity);
+  REQUIRE(futures);
+  for (size_t i = 0; i < futures->size(); i++) {
+    CHECK((*futures)[i].get() == i);
+  }
+}